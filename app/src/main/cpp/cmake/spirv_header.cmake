@@ -0,0 +1,45 @@
+# Copyright 2022 Eli Bukchin
+#
+#   Licensed under the Apache License, Version 2.0 (the "License");
+#   you may not use this file except in compliance with the License.
+#   You may obtain a copy of the License at
+#
+#       http:#www.apache.org/licenses/LICENSE-2.0
+#
+#   Unless required by applicable law or agreed to in writing, software
+#   distributed under the License is distributed on an "AS IS" BASIS,
+#   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+#   See the License for the specific language governing permissions and
+#   limitations under the License.
+
+# Embeds a SPIR-V binary as a uint32_t array:
+#   cmake -DINPUT=cube.vert.spv -DOUTPUT=cube.vert.spv.h -DVARIABLE=vertSpv -P spirv_header.cmake
+
+file(READ ${INPUT} HEX HEX)
+string(LENGTH "${HEX}" LENGTH)
+
+set(WORDS "")
+set(INDEX 0)
+set(COLUMN 0)
+while(INDEX LESS LENGTH)
+    # NOTE: SPIR-V words are little endian
+    math(EXPR B1 "${INDEX} + 2")
+    math(EXPR B2 "${INDEX} + 4")
+    math(EXPR B3 "${INDEX} + 6")
+    string(SUBSTRING "${HEX}" ${INDEX} 2 BYTE0)
+    string(SUBSTRING "${HEX}" ${B1} 2 BYTE1)
+    string(SUBSTRING "${HEX}" ${B2} 2 BYTE2)
+    string(SUBSTRING "${HEX}" ${B3} 2 BYTE3)
+    string(APPEND WORDS "0x${BYTE3}${BYTE2}${BYTE1}${BYTE0},")
+
+    math(EXPR INDEX "${INDEX} + 8")
+    math(EXPR COLUMN "(${COLUMN} + 1) % 4")
+    if(COLUMN EQUAL 0)
+        string(APPEND WORDS "\n")
+    else()
+        string(APPEND WORDS " ")
+    endif()
+endwhile()
+
+get_filename_component(SOURCE ${INPUT} NAME)
+file(WRITE ${OUTPUT} "// Generated from ${SOURCE}, do not edit\nstatic const uint32_t ${VARIABLE}[] = {\n${WORDS}};\n")
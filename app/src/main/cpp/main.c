@@ -31,6 +31,10 @@
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
+#include <float.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
 
 #define CFATAL(msg, ...) __android_log_print(ANDROID_LOG_FATAL, "myoculustest", msg, ##__VA_ARGS__)
 #define CERROR(msg, ...) __android_log_print(ANDROID_LOG_ERROR, "myoculustest", msg, ##__VA_ARGS__)
@@ -46,6 +50,58 @@
 
 #define UNKNOWN_SIZE 2
 
+#define SWAPCHAIN_WAIT_TIMEOUT_NS 100000000  // 100ms per attempt
+#define SWAPCHAIN_WAIT_MAX_ATTEMPTS 10
+#define SWAPCHAIN_WAIT_REPORT_INTERVAL 512
+
+#define GPU_WAIT_TIMEOUT_NS 5000000000ull
+#define MAX_DEFERRED_DESTROYS 256
+#define MAX_PENDING_BARRIERS 8
+#define MAX_OBJECTS 64
+#define FRAMES_IN_FLIGHT 2
+#define FRAME_RING_REGION_SIZE (64 * 1024)
+#define DESCRIPTOR_SETS_PER_POOL 16
+#define MAX_DESCRIPTOR_POOLS 4
+#define DEPTH_PREFER_D16 0  // NOTE: 1 tries the D16 entry first, for scenes that fit its 20 m range and want the bandwidth
+#define DEPTH_STEP_DISTANCE 100.0f  // NOTE: where the depth step is reported when the far plane is infinite
+#define MSAA_SAMPLES 0  // NOTE: 0 follows recommendedSwapchainSampleCount, a count overrides it, both are clamped to what the device supports
+
+#define SPEC_INSTANCED 0  // NOTE: constant_id in shaders/cube.vert
+#define MAX_PIPELINES 32  // NOTE: power of two, slots of the open addressed pipeline cache
+#define PIPELINE_WORKERS 2
+#define PIPELINE_LIBRARY_PARTS 4
+#define UPLOAD_STAGING_SIZE (256 * 1024)
+#define MAX_UPLOADS 16
+#define MAX_MEMORY_ALLOCATIONS 128
+#define MEMORY_BUDGET_INTERVAL_NS 1000000000ull  // NOTE: the budget query isn't free, once a second is plenty
+#define MEMORY_WARN_PERCENT 80
+#define MEMORY_CRITICAL_PERCENT 95
+#define MAX_PIPELINE_LIBRARIES 32  // NOTE: power of two
+#define MAX_RENDER_PASSES 4
+#define TRACK_HOST_ALLOCATIONS 1  // NOTE: 0 hands the driver a null allocator, it then uses its own heap untracked
+#define HOST_ALLOCATION_SCOPES 5  // NOTE: VK_SYSTEM_ALLOCATION_SCOPE_COMMAND .. VK_SYSTEM_ALLOCATION_SCOPE_INSTANCE
+#define HOST_FRAME_ALLOCATION_WARNINGS 16
+#define RESOLUTION_SCALE 1.0f  // NOTE: multiplies the recommended swapchain size, RESOLUTION_SCALE_PROPERTY overrides it
+#define RESOLUTION_SCALE_PROPERTY "debug.myoculustest.scale"  // NOTE: adb shell setprop debug.myoculustest.scale 1.25
+#define MIN_RESOLUTION_SCALE 0.5f
+#define MAX_RESOLUTION_SCALE 2.0f
+#define SWAPCHAIN_SIZE_POLL_NS 1000000000ull
+#define DYNAMIC_RESOLUTION 1  // NOTE: 0 always renders the whole swapchain image
+#define DYNRES_MIN_SCALE 0.7f
+#define DYNRES_TARGET_PERCENT 85  // NOTE: of the display period, GPU time above it drops the render size right away
+#define DYNRES_RAISE_PERCENT 70   // NOTE: below it for DYNRES_RAISE_FRAMES frames in a row the render size climbs a step
+#define DYNRES_RAISE_FRAMES 30
+#define DYNRES_RAISE_STEP 0.02f
+#define FOVEATION_LEVEL XR_FOVEATION_LEVEL_MEDIUM_FB  // NOTE: where the performance controller starts and settles back to
+#define FOVEATION_DYNAMIC 1  // NOTE: the runtime may pick a lower level from its own GPU load, the set level is the ceiling
+#define FOVEATION_DENSITY_FORMAT VK_FORMAT_R8G8_UNORM
+#define GENERATED_FOVEATION 1  // NOTE: without XR_FB_foveation build our own density or shading rate maps, 0 renders at full rate
+#define SHADING_RATE_FORMAT VK_FORMAT_R8_UINT
+#define VISIBILITY_MASK 1  // NOTE: 0 shades the area hidden by the lenses like the rest of the view
+#define VISIBILITY_MASK_DEPTH 1.01f  // NOTE: of nearZ, the hidden area mesh sits just past the near plane so it isn't clipped
+#define MAX_MASK_VERTICES 512  // NOTE: both views' meshes go through the frame ring, FRAME_RING_REGION_SIZE has room for them
+#define MAX_MASK_INDICES 1536
+
 #define CHECKXR(res, errmsg, ...)      \
     if (!XR_SUCCEEDED(res)) {          \
         CERROR(errmsg, ##__VA_ARGS__); \
@@ -66,37 +122,86 @@ typedef enum Sides {
     SIDE_COUNT
 } Sides;
 
-typedef struct AndroidAppState {
-    ANativeWindow* window;
-    bool resumed;
-} AndroidAppState;
+// NOTE: stage/access hold VkPipelineStageFlags2/VkAccessFlags2 bits, the low 32 bits match the legacy flags
+typedef struct ImageState {
+    VkImageLayout layout;
+    uint64_t stage;
+    uint64_t access;
+} ImageState;
 
 typedef struct RenderTarget {
     VkImageView colorView;
     VkImageView depthView;
+    VkImageView densityView;  // NOTE: the runtime's fragment density map for this image, only with FOVEATION_Runtime
     VkFramebuffer fb;
+    ImageState colorState;
 } RenderTarget;
 
 typedef struct DepthBuffer {
     VkDeviceMemory depthMemory;
     VkImage depthImage;
-    VkImageLayout vkLayout;
+    ImageState state;
+    VkDeviceSize size;
+    bool lazy;  // NOTE: backed by LAZILY_ALLOCATED memory, tilers may never commit it
 } DepthBuffer;
 
+// NOTE: multisampled color that lives on tile and gets resolved into the swapchain image
+typedef struct ColorBuffer {
+    VkDeviceMemory colorMemory;
+    VkImage colorImage;
+    VkImageView colorView;
+    ImageState state;
+    VkDeviceSize size;
+    bool lazy;
+} ColorBuffer;
+
 typedef struct RenderPass {
     VkFormat colorFmt;
     VkFormat depthFmt;
+    VkSampleCountFlagBits samples;
+    bool storeDepth;
+    bool densityMap;   // NOTE: the last attachment is a fragment density map
+    bool shadingRate;  // NOTE: the last attachment is a fragment shading rate image, the pass is a renderpass2 one
     VkRenderPass pass;
 } RenderPass;
 
+// NOTE: a generated foveation map, one texel per texel sized block of the swapchain image. The contents are rebuilt
+//       through the staging buffer whenever the level, the render size or the projection center moved.
+typedef struct ShadingMap {
+    VkImage image;
+    VkDeviceMemory memory;
+    VkImageView view;
+    VkBuffer staging;
+    VkDeviceMemory stagingMemory;
+    uint8_t* mapped;
+    bool coherent;
+    VkFormat format;
+    VkExtent2D texel;   // NOTE: swapchain pixels per map texel
+    VkExtent2D extent;  // NOTE: in map texels
+    VkDeviceSize size;
+    ImageState state;
+    ImageState read;  // NOTE: how the render pass reads it
+    float center[2];  // NOTE: the projection center in the rendered sub-rect, 0-1, updated every frame
+    float generatedCenter[2];
+    VkExtent2D generatedSize;
+    uint32_t generatedLevel;  // NOTE: XrFoveationLevelFB of the contents, UINT32_MAX when there are none
+} ShadingMap;
+
 typedef struct SwapchainImageContext {
     XrSwapchainImageVulkan2KHR swapchainImages[MAX_IMAGES];
+    XrSwapchainImageFoveationVulkanFB foveationImages[MAX_IMAGES];  // NOTE: chained onto swapchainImages with foveation
     RenderTarget renderTarget[MAX_IMAGES];
     uint32_t imageCount;
     VkExtent2D size;
+    VkSampleCountFlagBits samples;
+    VkExtent2D renderSize;  // NOTE: the sub-rect rendered this frame, at most size
+    bool submitDepth;  // NOTE: depth is handed to the compositor, so it must be stored after the pass
     DepthBuffer depthBuffer;
+    ColorBuffer msaaColor;  // NOTE: only when samples > 1
     RenderPass rp;
-    VkPipeline pipe;
+    ShadingMap shadingMap;  // NOTE: only with FOVEATION_DensityMap or FOVEATION_ShadingRate
+    struct PipelineEntry* pipeline;      // NOTE: owned by the pipeline cache, may still be compiling
+    struct PipelineEntry* maskPipeline;  // NOTE: the hidden area mesh, only with XR_KHR_visibility_mask
     VkPrimitiveTopology topology;
     XrStructureType swapchainImageType;
 } SwapchainImageContext;
@@ -109,6 +214,52 @@ typedef enum CmdBufferState {
     CBR_STATE_Executing
 } CmdBufferState;
 
+#define ACCESS_WRITE_MASK (VK_ACCESS_SHADER_WRITE_BIT |                  \
+                           VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT |         \
+                           VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT | \
+                           VK_ACCESS_TRANSFER_WRITE_BIT |                 \
+                           VK_ACCESS_HOST_WRITE_BIT |                     \
+                           VK_ACCESS_MEMORY_WRITE_BIT)
+
+static const ImageState IMAGE_STATE_UNDEFINED = {
+    .layout = VK_IMAGE_LAYOUT_UNDEFINED};
+
+// NOTE: what the runtime guarantees for an image returned by xrWaitSwapchainImage
+static const ImageState IMAGE_STATE_ACQUIRED = {
+    .layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL};
+
+static const ImageState IMAGE_STATE_COLOR_ATTACHMENT = {
+    .layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
+    .stage = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
+    .access = VK_ACCESS_COLOR_ATTACHMENT_READ_BIT | VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT};
+
+static const ImageState IMAGE_STATE_DEPTH_ATTACHMENT = {
+    .layout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL,
+    .stage = VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT,
+    .access = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT};
+
+static const ImageState IMAGE_STATE_TRANSFER_DST = {
+    .layout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+    .stage = VK_PIPELINE_STAGE_TRANSFER_BIT,
+    .access = VK_ACCESS_TRANSFER_WRITE_BIT};
+
+// NOTE: the near/far pair travels with the format so a format can trade range for precision,
+//       with reverseZ the far plane may be INFINITY
+typedef struct DepthConfig {
+    VkFormat format;
+    float nearZ;
+    float farZ;
+    bool reverseZ;  // NOTE: near maps to 1 and far to 0, compare GREATER and clear to 0. Only a float format gains from it
+} DepthConfig;
+
+// NOTE: preference order, the first format usable as an optimal-tiling depth attachment wins. Every device has
+//       X8_D24 or D32, so the D16 entry is only reached through DEPTH_PREFER_D16. Its range is cut to 20 m with a
+//       larger near plane, 16 bits can't hold the 0.05 - 100 range of the others.
+static const DepthConfig DEPTH_CONFIGS[] = {
+    {.format = VK_FORMAT_D32_SFLOAT, .nearZ = 0.05f, .farZ = INFINITY, .reverseZ = true},
+    {.format = VK_FORMAT_X8_D24_UNORM_PACK32, .nearZ = 0.05f, .farZ = 100.0f, .reverseZ = false},
+    {.format = VK_FORMAT_D16_UNORM, .nearZ = 0.1f, .farZ = 20.0f, .reverseZ = false}};
+
 static char* CBR_STATE_STR[] = {
     "Undefined",
     "Initialized",
@@ -125,120 +276,9 @@ static char* VISULAIZED_SPACES[] = {
     "StageLeftRotated",
     "StageRightRotated"};
 
-static const uint32_t vertSpv[] = {0x07230203, 0x00010000, 0x000d000a, 0x00000029,
-                                   0x00000000, 0x00020011, 0x00000001, 0x0006000b,
-                                   0x00000001, 0x4c534c47, 0x6474732e, 0x3035342e,
-                                   0x00000000, 0x0003000e, 0x00000000, 0x00000001,
-                                   0x0009000f, 0x00000000, 0x00000004, 0x6e69616d,
-                                   0x00000000, 0x00000009, 0x0000000c, 0x00000017,
-                                   0x00000021, 0x00030003, 0x00000002, 0x00000190,
-                                   0x00090004, 0x415f4c47, 0x735f4252, 0x72617065,
-                                   0x5f657461, 0x64616873, 0x6f5f7265, 0x63656a62,
-                                   0x00007374, 0x00090004, 0x415f4c47, 0x735f4252,
-                                   0x69646168, 0x6c5f676e, 0x75676e61, 0x5f656761,
-                                   0x70303234, 0x006b6361, 0x000a0004, 0x475f4c47,
-                                   0x4c474f4f, 0x70635f45, 0x74735f70, 0x5f656c79,
-                                   0x656e696c, 0x7269645f, 0x69746365, 0x00006576,
-                                   0x00080004, 0x475f4c47, 0x4c474f4f, 0x6e695f45,
-                                   0x64756c63, 0x69645f65, 0x74636572, 0x00657669,
-                                   0x00040005, 0x00000004, 0x6e69616d, 0x00000000,
-                                   0x00040005, 0x00000009, 0x6c6f436f, 0x0000726f,
-                                   0x00040005, 0x0000000c, 0x6f6c6f43, 0x00000072,
-                                   0x00060005, 0x00000015, 0x505f6c67, 0x65567265,
-                                   0x78657472, 0x00000000, 0x00060006, 0x00000015,
-                                   0x00000000, 0x505f6c67, 0x7469736f, 0x006e6f69,
-                                   0x00030005, 0x00000017, 0x00000000, 0x00030005,
-                                   0x0000001b, 0x00667562, 0x00040006, 0x0000001b,
-                                   0x00000000, 0x0070766d, 0x00040005, 0x0000001d,
-                                   0x66756275, 0x00000000, 0x00050005, 0x00000021,
-                                   0x69736f50, 0x6e6f6974, 0x00000000, 0x00040047,
-                                   0x00000009, 0x0000001e, 0x00000000, 0x00040047,
-                                   0x0000000c, 0x0000001e, 0x00000001, 0x00050048,
-                                   0x00000015, 0x00000000, 0x0000000b, 0x00000000,
-                                   0x00030047, 0x00000015, 0x00000002, 0x00040048,
-                                   0x0000001b, 0x00000000, 0x00000005, 0x00050048,
-                                   0x0000001b, 0x00000000, 0x00000023, 0x00000000,
-                                   0x00050048, 0x0000001b, 0x00000000, 0x00000007,
-                                   0x00000010, 0x00030047, 0x0000001b, 0x00000002,
-                                   0x00040047, 0x00000021, 0x0000001e, 0x00000000,
-                                   0x00020013, 0x00000002, 0x00030021, 0x00000003,
-                                   0x00000002, 0x00030016, 0x00000006, 0x00000020,
-                                   0x00040017, 0x00000007, 0x00000006, 0x00000004,
-                                   0x00040020, 0x00000008, 0x00000003, 0x00000007,
-                                   0x0004003b, 0x00000008, 0x00000009, 0x00000003,
-                                   0x00040017, 0x0000000a, 0x00000006, 0x00000003,
-                                   0x00040020, 0x0000000b, 0x00000001, 0x0000000a,
-                                   0x0004003b, 0x0000000b, 0x0000000c, 0x00000001,
-                                   0x0004002b, 0x00000006, 0x00000010, 0x3f800000,
-                                   0x00040015, 0x00000011, 0x00000020, 0x00000000,
-                                   0x0004002b, 0x00000011, 0x00000012, 0x00000003,
-                                   0x00040020, 0x00000013, 0x00000003, 0x00000006,
-                                   0x0003001e, 0x00000015, 0x00000007, 0x00040020,
-                                   0x00000016, 0x00000003, 0x00000015, 0x0004003b,
-                                   0x00000016, 0x00000017, 0x00000003, 0x00040015,
-                                   0x00000018, 0x00000020, 0x00000001, 0x0004002b,
-                                   0x00000018, 0x00000019, 0x00000000, 0x00040018,
-                                   0x0000001a, 0x00000007, 0x00000004, 0x0003001e,
-                                   0x0000001b, 0x0000001a, 0x00040020, 0x0000001c,
-                                   0x00000009, 0x0000001b, 0x0004003b, 0x0000001c,
-                                   0x0000001d, 0x00000009, 0x00040020, 0x0000001e,
-                                   0x00000009, 0x0000001a, 0x0004003b, 0x0000000b,
-                                   0x00000021, 0x00000001, 0x00050036, 0x00000002,
-                                   0x00000004, 0x00000000, 0x00000003, 0x000200f8,
-                                   0x00000005, 0x0004003d, 0x0000000a, 0x0000000d,
-                                   0x0000000c, 0x0004003d, 0x00000007, 0x0000000e,
-                                   0x00000009, 0x0009004f, 0x00000007, 0x0000000f,
-                                   0x0000000e, 0x0000000d, 0x00000004, 0x00000005,
-                                   0x00000006, 0x00000003, 0x0003003e, 0x00000009,
-                                   0x0000000f, 0x00050041, 0x00000013, 0x00000014,
-                                   0x00000009, 0x00000012, 0x0003003e, 0x00000014,
-                                   0x00000010, 0x00050041, 0x0000001e, 0x0000001f,
-                                   0x0000001d, 0x00000019, 0x0004003d, 0x0000001a,
-                                   0x00000020, 0x0000001f, 0x0004003d, 0x0000000a,
-                                   0x00000022, 0x00000021, 0x00050051, 0x00000006,
-                                   0x00000023, 0x00000022, 0x00000000, 0x00050051,
-                                   0x00000006, 0x00000024, 0x00000022, 0x00000001,
-                                   0x00050051, 0x00000006, 0x00000025, 0x00000022,
-                                   0x00000002, 0x00070050, 0x00000007, 0x00000026,
-                                   0x00000023, 0x00000024, 0x00000025, 0x00000010,
-                                   0x00050091, 0x00000007, 0x00000027, 0x00000020,
-                                   0x00000026, 0x00050041, 0x00000008, 0x00000028,
-                                   0x00000017, 0x00000019, 0x0003003e, 0x00000028,
-                                   0x00000027, 0x000100fd, 0x00010038};
-
-static const uint32_t fragSpv[] = {0x07230203, 0x00010000, 0x000d000a, 0x0000000d,
-                                   0x00000000, 0x00020011, 0x00000001, 0x0006000b,
-                                   0x00000001, 0x4c534c47, 0x6474732e, 0x3035342e,
-                                   0x00000000, 0x0003000e, 0x00000000, 0x00000001,
-                                   0x0007000f, 0x00000004, 0x00000004, 0x6e69616d,
-                                   0x00000000, 0x00000009, 0x0000000b, 0x00030010,
-                                   0x00000004, 0x00000007, 0x00030003, 0x00000002,
-                                   0x00000190, 0x00090004, 0x415f4c47, 0x735f4252,
-                                   0x72617065, 0x5f657461, 0x64616873, 0x6f5f7265,
-                                   0x63656a62, 0x00007374, 0x00090004, 0x415f4c47,
-                                   0x735f4252, 0x69646168, 0x6c5f676e, 0x75676e61,
-                                   0x5f656761, 0x70303234, 0x006b6361, 0x000a0004,
-                                   0x475f4c47, 0x4c474f4f, 0x70635f45, 0x74735f70,
-                                   0x5f656c79, 0x656e696c, 0x7269645f, 0x69746365,
-                                   0x00006576, 0x00080004, 0x475f4c47, 0x4c474f4f,
-                                   0x6e695f45, 0x64756c63, 0x69645f65, 0x74636572,
-                                   0x00657669, 0x00040005, 0x00000004, 0x6e69616d,
-                                   0x00000000, 0x00050005, 0x00000009, 0x67617246,
-                                   0x6f6c6f43, 0x00000072, 0x00040005, 0x0000000b,
-                                   0x6c6f436f, 0x0000726f, 0x00040047, 0x00000009,
-                                   0x0000001e, 0x00000000, 0x00040047, 0x0000000b,
-                                   0x0000001e, 0x00000000, 0x00020013, 0x00000002,
-                                   0x00030021, 0x00000003, 0x00000002, 0x00030016,
-                                   0x00000006, 0x00000020, 0x00040017, 0x00000007,
-                                   0x00000006, 0x00000004, 0x00040020, 0x00000008,
-                                   0x00000003, 0x00000007, 0x0004003b, 0x00000008,
-                                   0x00000009, 0x00000003, 0x00040020, 0x0000000a,
-                                   0x00000001, 0x00000007, 0x0004003b, 0x0000000a,
-                                   0x0000000b, 0x00000001, 0x00050036, 0x00000002,
-                                   0x00000004, 0x00000000, 0x00000003, 0x000200f8,
-                                   0x00000005, 0x0004003d, 0x00000007, 0x0000000c,
-                                   0x0000000b, 0x0003003e, 0x00000009, 0x0000000c,
-                                   0x000100fd, 0x00010038};
+// NOTE: generated at build time from shaders/cube.vert and shaders/cube.frag
+#include "cube.vert.spv.h"
+#include "cube.frag.spv.h"
 
 typedef struct Vertex {
     XrVector3f pos;
@@ -302,6 +342,22 @@ const uint16_t cubeIndices[] = {
     30, 31, 32, 33, 34, 35,  // +Z
 };
 
+static uint64_t time_now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static uint64_t hash_fnv1a(const void* data, size_t size) {
+    const uint8_t* bytes = (const uint8_t*)data;
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for (size_t i = 0; i < size; ++i) {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ull;
+    }
+    return hash;
+}
+
 static XrPosef pose_identity() {
     XrPosef result = {
         .orientation.w = 1.0f};
@@ -377,6 +433,18 @@ static void mat_create_proj(XrMatrix4x4f* mat, XrFovf fov, float near, float far
     mat->m[15] = 0.0f;
 }
 
+// NOTE: maps near to 1 and far to 0 so float depth keeps its precision in the distance, far = INFINITY drops the far plane
+static void mat_create_proj_reverse_z(XrMatrix4x4f* mat, XrFovf fov, float near, float far) {
+    mat_create_proj(mat, fov, near, far);
+    if (isinf(far)) {
+        mat->m[10] = 0.0f;
+        mat->m[14] = near;
+    } else {
+        mat->m[10] = near / (far - near);
+        mat->m[14] = far * near / (far - near);
+    }
+}
+
 static void mat_from_quat(XrMatrix4x4f* mat, XrQuaternionf* quat) {
     float x2 = quat->x + quat->x;
     float y2 = quat->y + quat->y;
@@ -489,13 +557,221 @@ static void mat_create_translation_rotation_scale(XrMatrix4x4f* mat, XrVector3f*
     mat_mul(mat, &translationMatrix, &combinedMatrix);
 }
 
+typedef struct ImageBarrier {
+    VkImage image;
+    VkImageAspectFlags aspect;
+    ImageState src;
+    ImageState dst;
+} ImageBarrier;
+
 typedef struct CmdBuffer {
     CmdBufferState state;
     VkCommandPool pool;
     VkCommandBuffer buf;
-    VkFence execFence;
+    VkFence execFence;     // NOTE: only used when timeline semaphores are unavailable
+    uint64_t submitValue;  // NOTE: frame sync value signaled by the last submission
+    ImageBarrier pendingBarriers[MAX_PENDING_BARRIERS];
+    uint32_t pendingBarrierCount;
 } CmdBuffer;
 
+typedef struct FrameSync {
+    VkSemaphore timeline;  // NOTE: VK_NULL_HANDLE when falling back to per commandbuffer fences
+    uint64_t submitted;    // NOTE: value signaled by the latest submission
+    uint64_t completed;    // NOTE: latest value the GPU was observed to pass
+} FrameSync;
+
+typedef enum DestroyType {
+    DESTROY_Buffer,
+    DESTROY_Image,
+    DESTROY_ImageView,
+    DESTROY_Framebuffer,
+    DESTROY_RenderPass,
+    DESTROY_Pipeline,
+    DESTROY_Memory,
+    DESTROY_Swapchain  // NOTE: retire after the views and framebuffers of its images
+} DestroyType;
+
+typedef union DestroyHandle {
+    VkBuffer buffer;
+    VkImage image;
+    VkImageView imageView;
+    VkFramebuffer framebuffer;
+    VkRenderPass renderPass;
+    VkPipeline pipeline;
+    VkDeviceMemory memory;
+    XrSwapchain swapchain;
+} DestroyHandle;
+
+typedef struct DeferredDestroy {
+    DestroyType type;
+    DestroyHandle handle;
+    uint64_t frame;  // NOTE: frame sync value of the last submission that may use the handle
+} DeferredDestroy;
+
+typedef struct DeferredDestroyQueue {
+    DeferredDestroy items[MAX_DEFERRED_DESTROYS];
+    uint32_t count;
+} DeferredDestroyQueue;
+
+// NOTE: shared is set when no separate queue was available and this aliases the graphics VkQueue,
+//       which the runtime also submits to, so it may only be used from the render thread
+typedef struct DeviceQueue {
+    uint32_t family;
+    uint32_t index;
+    VkQueue queue;
+    bool shared;
+} DeviceQueue;
+
+typedef enum MemoryCategory {
+    MEMORY_Geometry,
+    MEMORY_Depth,
+    MEMORY_Framebuffer,
+    MEMORY_Staging,
+    MEMORY_Texture,
+    MEMORY_CATEGORY_COUNT
+} MemoryCategory;
+
+static char* MEMORY_CATEGORY_STR[] = {
+    "Geometry",
+    "Depth",
+    "Framebuffer",
+    "Staging",
+    "Texture"};
+
+typedef struct MemoryAllocation {
+    VkDeviceMemory memory;
+    VkDeviceSize size;
+    uint32_t heap;
+    MemoryCategory category;
+} MemoryAllocation;
+
+static char* HOST_ALLOCATION_SCOPE_STR[] = {
+    "Command",
+    "Object",
+    "Cache",
+    "Device",
+    "Instance"};
+
+typedef struct HostAllocationScope {
+    _Atomic uint64_t count;     // NOTE: reallocations count as a new allocation
+    _Atomic uint64_t live;      // NOTE: bytes
+    _Atomic uint64_t peak;      // NOTE: bytes
+    _Atomic uint64_t internal;  // NOTE: bytes the driver allocated itself and only notified us about
+} HostAllocationScope;
+
+// NOTE: driver host allocations go through these callbacks, the render thread flags the frame loop
+//       so anything it allocates in there shows up, steady state frames should allocate nothing
+typedef struct HostAllocator {
+    VkAllocationCallbacks callbacks;
+    HostAllocationScope scopes[HOST_ALLOCATION_SCOPES];
+    pthread_t frameThread;
+    _Atomic bool inFrame;
+    _Atomic uint64_t frameAllocations;
+    _Atomic uint64_t frameBytes;
+} HostAllocator;
+
+// NOTE: sits right in front of the aligned pointer handed to the driver
+typedef struct HostAllocationHeader {
+    void* block;  // NOTE: what malloc returned
+    size_t size;
+    VkSystemAllocationScope scope;
+} HostAllocationHeader;
+
+// NOTE: our own allocations per category and heap, the budget extension adds what the whole process uses
+//       and what the OS lets it have, without it the heap size stands in for the budget
+typedef struct MemoryTracker {
+    MemoryAllocation allocations[MAX_MEMORY_ALLOCATIONS];
+    uint32_t allocationCount;
+    VkDeviceSize category[MEMORY_CATEGORY_COUNT];
+    VkDeviceSize total;
+    VkDeviceSize peak;
+    VkDeviceSize heapAllocated[VK_MAX_MEMORY_HEAPS];
+    VkDeviceSize heapUsage[VK_MAX_MEMORY_HEAPS];
+    VkDeviceSize heapBudget[VK_MAX_MEMORY_HEAPS];
+    uint32_t heapLevel[VK_MAX_MEMORY_HEAPS];  // NOTE: 0 fine, 1 past MEMORY_WARN_PERCENT, 2 past MEMORY_CRITICAL_PERCENT
+    uint64_t lastQuery;
+} MemoryTracker;
+
+typedef struct VulkanCaps {
+    bool timelineSemaphore;
+    bool dynamicRendering;  // NOTE: render straight into image views, no VkRenderPass/VkFramebuffer
+    bool synchronization2;
+    bool graphicsPipelineLibrary;  // NOTE: fast linking of prebuilt pipeline libraries
+    bool memoryBudget;
+    bool timestamps;  // NOTE: the graphics family has valid timestamp bits
+    bool fragmentDensityMap;
+    bool fragmentShadingRate;  // NOTE: attachment shading rate, needs renderpass2
+} VulkanCaps;
+
+typedef enum FoveationMode {
+    FOVEATION_Off,
+    FOVEATION_Runtime,     // NOTE: XR_FB_foveation hands out a density map with every swapchain image
+    FOVEATION_DensityMap,  // NOTE: a generated VK_EXT_fragment_density_map per view
+    FOVEATION_ShadingRate  // NOTE: a generated VK_KHR_fragment_shading_rate attachment per view
+} FoveationMode;
+
+static char* FOVEATION_MODE_STR[] = {
+    "Off",
+    "Runtime",
+    "Density map",
+    "Shading rate"};
+
+// NOTE: per XrFoveationLevelFB, the radius (1 = image border) where the generated maps start to drop below full
+//       rate and the density they fall to at the border
+static const float FOVEATION_FALLOFF[][2] = {
+    {0.8f, 1.0f},
+    {0.6f, 0.5f},
+    {0.45f, 0.5f},
+    {0.35f, 0.25f}};
+
+// NOTE: a begin and an end timestamp around each view's command buffer
+typedef struct GpuTimer {
+    VkQueryPool pool;
+    uint64_t mask;  // NOTE: timestampValidBits of the graphics family
+} GpuTimer;
+
+typedef enum UploadState {
+    UPLOAD_Free,
+    UPLOAD_Queued,
+    UPLOAD_Transferred,  // NOTE: copied, the graphics queue still has to acquire it
+    UPLOAD_Ready,
+    UPLOAD_Failed
+} UploadState;
+
+// NOTE: data has to stay valid until the job leaves UPLOAD_Queued,
+//       dstState is how the graphics queue reads the buffer, the ownership acquire targets it
+typedef struct UploadJob {
+    VkBuffer dst;
+    const void* data;
+    VkDeviceSize size;
+    ImageState dstState;
+    _Atomic uint32_t state;
+} UploadJob;
+
+// NOTE: a worker copies jobs through one staging buffer on the transfer queue, one chunk in flight at a time.
+//       When the transfer queue is the shared graphics VkQueue the render thread submits the recorded chunk instead.
+typedef struct UploadService {
+    pthread_t worker;
+    bool started;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;  // NOTE: job queued, chunk finished or quit
+    bool quit;
+    UploadJob jobs[MAX_UPLOADS];
+    uint32_t queue[MAX_UPLOADS];
+    uint32_t head;
+    uint32_t tail;
+    VkCommandPool pool;
+    VkCommandBuffer cmd;
+    VkFence fence;
+    VkBuffer staging;
+    VkDeviceMemory stagingMem;
+    uint8_t* stagingMapped;
+    bool recorded;  // NOTE: shared queue only, cmd waits for the render thread to submit it
+    bool inFlight;  // NOTE: shared queue only, submitted and fence not seen yet
+    bool submitFailed;
+    uint64_t uploaded;  // NOTE: bytes copied so far
+} UploadService;
+
 typedef struct VertexBuffer {
     VkBuffer idxBuf;
     VkDeviceMemory idxMem;
@@ -503,10 +779,143 @@ typedef struct VertexBuffer {
     VkBuffer vtxBuf;
     VkDeviceMemory vtxMem;
     uint32_t vtxCount;
+    UploadJob* idxUpload;
+    UploadJob* vtxUpload;
     VkVertexInputBindingDescription bindDesc;
     VkVertexInputAttributeDescription attrDesc[NUM_VERTEX_ATTRIBUTES];
 } VertexBuffer;
 
+typedef struct CameraData {
+    XrMatrix4x4f view;
+    XrMatrix4x4f proj;
+} CameraData;
+
+// NOTE: std430 layout of the vertex shader's ObjectData, 80 bytes per object
+typedef struct ObjectData {
+    XrMatrix4x4f model;
+    XrColor4f color;
+} ObjectData;
+
+// NOTE: persistently mapped host buffer split into one region per frame in flight,
+//       each frame bump allocates from its region and binds the results with dynamic offsets
+typedef struct FrameRing {
+    VkBuffer buf;
+    VkDeviceMemory mem;
+    uint8_t* mapped;
+    bool coherent;
+    VkDeviceSize regionSize;
+    VkDeviceSize alignment;  // NOTE: covers the UBO/SSBO offset alignment and nonCoherentAtomSize
+    uint32_t region;
+    VkDeviceSize head;                         // NOTE: bump offset inside the current region
+    uint64_t regionFrame[FRAMES_IN_FLIGHT];  // NOTE: frame sync value of the last submission reading each region
+} FrameRing;
+
+typedef struct RingAllocation {
+    void* data;
+    uint32_t offset;  // NOTE: from the start of the ring buffer, usable as a dynamic offset
+} RingAllocation;
+
+typedef struct FrameData {
+    FrameRing ring;
+    uint32_t cameraOffset[NUM_VIEWES];
+    uint32_t objectOffset;
+    uint32_t objectCount;  // NOTE: drawn as instances, gl_InstanceIndex picks the object
+    uint32_t maskCameraOffset[NUM_VIEWES];  // NOTE: identity view, the hidden area mesh is already in view space
+    uint32_t maskVertexOffset[NUM_VIEWES];
+    uint32_t maskIndexOffset[NUM_VIEWES];
+    uint32_t maskIndexCount[NUM_VIEWES];  // NOTE: 0 leaves the view unmasked
+    VkDescriptorSet set;
+} FrameData;
+
+// NOTE: XR_KHR_visibility_mask hidden triangle mesh of a view, the vertices are tangents on the z = -1 plane
+typedef struct VisibilityMask {
+    XrVector2f vertices[MAX_MASK_VERTICES];
+    uint32_t indices[MAX_MASK_INDICES];
+    uint32_t vertexCount;
+    uint32_t indexCount;
+} VisibilityMask;
+
+// NOTE: specialization constant values, laid out for VkSpecializationMapEntry
+typedef struct ShaderVariant {
+    VkBool32 instanced;
+} ShaderVariant;
+
+// NOTE: everything baked into a pipeline, viewport and scissor are dynamic so the extent is not part of it,
+//       hashed and compared as raw bytes so build it with vulkan_pipeline_key
+typedef struct PipelineKey {
+    ShaderVariant variant;
+    VkPrimitiveTopology topology;
+    VkCullModeFlags cullMode;
+    VkBool32 blendEnable;
+    VkBool32 depthTest;
+    VkBool32 depthWrite;
+    VkCompareOp depthCompare;
+    VkSampleCountFlagBits samples;
+    VkFormat colorFmt;
+    VkFormat depthFmt;
+    uint32_t viewMask;
+    VkBool32 shadingRate;  // NOTE: combine the pass's shading rate attachment in
+    VkRenderPass pass;     // NOTE: null with dynamic rendering
+} PipelineKey;
+
+typedef enum PipelineState {
+    PIPELINE_Empty,
+    PIPELINE_Queued,
+    PIPELINE_Linked,  // NOTE: fastPipe is usable, the optimized link is queued
+    PIPELINE_Ready,
+    PIPELINE_Failed
+} PipelineState;
+
+// NOTE: hash, key, libraries and fastPipe are written by the render thread before the entry is queued,
+//       a worker publishes pipe with a release store of state
+typedef struct PipelineEntry {
+    uint64_t hash;
+    PipelineKey key;
+    VkPipeline pipe;
+    VkPipeline fastPipe;  // NOTE: linked without optimization, retired once pipe is ready
+    VkPipeline libraries[PIPELINE_LIBRARY_PARTS];
+    _Atomic uint32_t state;
+} PipelineEntry;
+
+// NOTE: one part of a pipeline, shared by every pipeline whose key matches in the fields the part depends on
+typedef struct PipelineLibrary {
+    uint64_t hash;
+    uint32_t part;  // NOTE: a single VkGraphicsPipelineLibraryFlagBitsEXT
+    PipelineKey key;
+    VkPipeline lib;
+} PipelineLibrary;
+
+// NOTE: worker threads compiling queued cache entries, the queue holds entry indices so it can't overflow
+typedef struct PipelineCompiler {
+    pthread_t workers[PIPELINE_WORKERS];
+    uint32_t workerCount;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;  // NOTE: a job was queued or the workers should quit
+    pthread_cond_t idle;  // NOTE: a job finished
+    uint32_t queue[MAX_PIPELINES];
+    uint32_t head;
+    uint32_t tail;
+    uint32_t busy;  // NOTE: jobs queued or compiling
+    bool quit;
+} PipelineCompiler;
+
+typedef struct PipelineCache {
+    PipelineEntry entries[MAX_PIPELINES];
+    PipelineLibrary libraries[MAX_PIPELINE_LIBRARIES];  // NOTE: render thread only
+    uint32_t libraryCount;
+    VkPipelineCache driverCache;  // NOTE: shared by the workers, vkCreateGraphicsPipelines synchronizes it internally
+    PipelineCompiler compiler;
+    uint32_t count;
+    uint32_t hits;
+    uint32_t skipped;   // NOTE: views recorded without a draw because their pipeline wasn't ready
+    uint64_t createNs;  // NOTE: total time spent in vkCreateGraphicsPipelines, guarded by the compiler lock
+} PipelineCache;
+
+typedef struct DescriptorAllocator {
+    VkDescriptorPool pools[MAX_DESCRIPTOR_POOLS];
+    uint32_t poolCount;
+} DescriptorAllocator;
+
 typedef struct VulkanState {
     SwapchainImageContext swapchainImageContext[NUM_VIEWES];
     // std::map<const XrSwapchainImageBaseHeader*, SwapchainImageContext*> m_swapchainImageContextMap; ????
@@ -516,17 +925,62 @@ typedef struct VulkanState {
     VkDevice device;
     uint32_t queueFamilyIndex;  // NOTE: Graphics queue
     VkQueue queue;
+    DeviceQueue transfer;  // NOTE: uploads, a DMA only family when the device has one
+    DeviceQueue compute;   // NOTE: async compute, a family without graphics when the device has one
+    VulkanCaps caps;
+    DepthConfig depth;
+
+    PFN_vkWaitSemaphoresKHR waitSemaphores;
+    PFN_vkGetSemaphoreCounterValueKHR getSemaphoreCounterValue;
+#if defined(VK_KHR_dynamic_rendering)
+    PFN_vkCmdBeginRenderingKHR cmdBeginRendering;
+    PFN_vkCmdEndRenderingKHR cmdEndRendering;
+#endif
+#if defined(VK_KHR_synchronization2)
+    PFN_vkCmdPipelineBarrier2KHR cmdPipelineBarrier2;
+#endif
+#if defined(VK_KHR_fragment_shading_rate)
+    PFN_vkCreateRenderPass2KHR createRenderPass2;
+#endif
 
     VkPhysicalDeviceMemoryProperties memProps;
+    MemoryTracker memory;
+    GpuTimer gpuTimer;
+    HostAllocator hostAllocator;
+    const VkAllocationCallbacks* allocator;  // NOTE: null when TRACK_HOST_ALLOCATIONS is off
+    VkPhysicalDeviceLimits limits;
     VkPipelineShaderStageCreateInfo shaderProgram[NUM_PIPELINE_STAGES];
-    CmdBuffer cmdBuffer;
+    CmdBuffer cmdBuffer[NUM_VIEWES];
+    FrameSync frameSync;
+    DeferredDestroyQueue deferredDestroys;
+    VkDescriptorSetLayout frameSetLayout;
+    DescriptorAllocator descriptors;
+    FrameData frame;
+    UploadService upload;
     VkPipelineLayout pipelineLayout;
+    PipelineCache pipelines;
+    RenderPass renderPasses[MAX_RENDER_PASSES];  // NOTE: shared by every view with the same formats, views hold copies
+    uint32_t renderPassCount;
     VertexBuffer drawBuffer;
+    bool transientReleased;  // NOTE: depth buffers, render targets and the frame ring are freed while paused
+    bool hiddenAreaMask;  // NOTE: views start by drawing the runtime's hidden area mesh at near plane depth
+    VisibilityMask visibilityMask[NUM_VIEWES];
+    FoveationMode foveation;
+    uint32_t foveationLevel;      // NOTE: XrFoveationLevelFB the generated maps follow
+    VkExtent2D densityTexel;      // NOTE: minFragmentDensityTexelSize, a map sized by it covers any texel size the device picks
+    VkExtent2D shadingRateTexel;  // NOTE: maxFragmentShadingRateAttachmentTexelSize
 #if defined(NDEBUG)
     VkDebugUtilsMessengerEXT debugMessenger;
 #endif
 } VulkanState;
 
+typedef struct AndroidAppState {
+    ANativeWindow* window;
+    bool resumed;
+    bool lowMemoryPause;  // NOTE: release recreatable GPU memory on APP_CMD_PAUSE
+    VulkanState* vulkan;
+} AndroidAppState;
+
 typedef struct XrInputState {
     XrActionSet actionsSet;
     XrAction grabAction;
@@ -545,6 +999,43 @@ typedef struct Swapchain {
     int32_t height;
 } Swapchain;
 
+typedef struct SwapchainWaitStats {
+    uint64_t waits;
+    uint64_t timeouts;
+    uint64_t totalNs;  // NOTE: since the last report
+    uint64_t maxNs;    // NOTE: since the last report
+} SwapchainWaitStats;
+
+typedef struct XrCaps {
+    bool recommendedLayerResolution;  // NOTE: XR_META_recommended_layer_resolution, missing from older headers
+    bool foveation;                   // NOTE: XR_FB_foveation with its configuration, vulkan and swapchain update state parts
+    bool visibilityMask;              // NOTE: XR_KHR_visibility_mask
+} XrCaps;
+
+static char* FOVEATION_LEVEL_STR[] = {
+    "None",
+    "Low",
+    "Medium",
+    "High"};
+
+typedef struct Foveation {
+    bool enabled;  // NOTE: any FoveationMode but FOVEATION_Off
+    bool runtime;  // NOTE: FOVEATION_Runtime, the level goes to the runtime instead of the generated maps
+    XrFoveationLevelFB level;
+    XrSwapchainCreateInfoFoveationFB swapchainCI;  // NOTE: chained onto every swapchain create info while enabled
+    PFN_xrCreateFoveationProfileFB createProfile;
+    PFN_xrDestroyFoveationProfileFB destroyProfile;
+    PFN_xrUpdateSwapchainFB updateSwapchain;
+} Foveation;
+
+// NOTE: swapchains stay at full size, the views render into a sub-rect of scale times that size
+typedef struct DynamicResolution {
+    float scale;
+    float maxScale;       // NOTE: 1, or less when the runtime recommends a smaller layer
+    uint64_t gpuNs;       // NOTE: summed view command buffer time of the last frame, 0 when unknown
+    uint32_t calmFrames;  // NOTE: frames in a row below DYNRES_RAISE_PERCENT
+} DynamicResolution;
+
 typedef struct OpenXrProgram {
     XrInstance instance;
     XrSession session;
@@ -556,6 +1047,16 @@ typedef struct OpenXrProgram {
     XrGraphicsBindingVulkan2KHR graphicsBinding;
     XrViewConfigurationView configViews[NUM_VIEWES];
     Swapchain swapchains[NUM_VIEWES];
+    float resolutionScale;
+    uint64_t lastSizePoll;
+    DynamicResolution resolution;
+    Foveation foveation;
+    XrCaps caps;
+#if defined(XR_META_recommended_layer_resolution)
+    PFN_xrGetRecommendedLayerResolutionMETA getRecommendedLayerResolution;
+#endif
+    PFN_xrGetVisibilityMaskKHR getVisibilityMask;
+    uint32_t visibilityMaskStale;  // NOTE: a bit per view, fetched again before the next frame
     XrView views[NUM_VIEWES];
     int64_t colorSwapchainFormat;
     XrSpace visualizedSpaces[array_size(VISULAIZED_SPACES)];
@@ -563,41 +1064,10 @@ typedef struct OpenXrProgram {
     bool sessionRunning;
     XrEventDataBuffer eventDataBuffer;
     XrInputState input;
+    SwapchainWaitStats swapchainWaitStats;
+    uint32_t acquiredViews;  // NOTE: a bit per view between xrAcquireSwapchainImage and xrReleaseSwapchainImage
 } OpenXrProgram;
 
-static void app_handle_cmd(struct android_app* app, int32_t cmd) {
-    AndroidAppState* state = (AndroidAppState*)app->userData;
-
-    switch (cmd) {
-        case APP_CMD_START: {
-            CINFO("onStart()");
-        } break;
-        case APP_CMD_RESUME: {
-            CINFO("onResume()");
-            state->resumed = true;
-        } break;
-        case APP_CMD_PAUSE: {
-            CINFO("onPause()");
-            state->resumed = false;
-        } break;
-        case APP_CMD_STOP: {
-            CINFO("onStop()");
-        } break;
-        case APP_CMD_DESTROY: {
-            CINFO("onDestroy()");
-            state->window = 0;
-        } break;
-        case APP_CMD_INIT_WINDOW: {
-            CINFO("surfaceCreated()");
-            state->window = app->window;
-        } break;
-        case APP_CMD_TERM_WINDOW: {
-            CINFO("surfaceDestroyed()");
-            state->window = 0;
-        } break;
-    }
-}
-
 static VKAPI_ATTR VkBool32 VKAPI_CALL vulkan_debug_callback(
     VkDebugUtilsMessageSeverityFlagBitsEXT messageSeverity,
     VkDebugUtilsMessageTypeFlagsEXT messageType,
@@ -623,13 +1093,139 @@ static VKAPI_ATTR VkBool32 VKAPI_CALL vulkan_debug_callback(
     return VK_FALSE;
 }
 
-static bool vulkan_commandbuffer_init(VkDevice device, uint32_t queueFamily, CmdBuffer* cbr) {
+#if TRACK_HOST_ALLOCATIONS
+// NOTE: a scope newer than the ones we know still gets its memory, it is only left out of the per-scope counters
+static void vulkan_host_track(HostAllocator* allocator, size_t size, VkSystemAllocationScope scope) {
+    if (scope < HOST_ALLOCATION_SCOPES) {
+        HostAllocationScope* stats = &allocator->scopes[scope];
+        atomic_fetch_add_explicit(&stats->count, 1, memory_order_relaxed);
+        uint64_t live = atomic_fetch_add_explicit(&stats->live, size, memory_order_relaxed) + size;
+        uint64_t peak = atomic_load_explicit(&stats->peak, memory_order_relaxed);
+        while (live > peak && !atomic_compare_exchange_weak_explicit(&stats->peak, &peak, live, memory_order_relaxed, memory_order_relaxed)) {
+        }
+    }
+
+    // NOTE: the pipeline and upload workers are free to allocate, only the render thread is held to zero
+    if (atomic_load_explicit(&allocator->inFrame, memory_order_relaxed) && pthread_equal(pthread_self(), allocator->frameThread)) {
+        uint64_t count = atomic_fetch_add_explicit(&allocator->frameAllocations, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&allocator->frameBytes, size, memory_order_relaxed);
+        if (count < HOST_FRAME_ALLOCATION_WARNINGS) {
+            CWARN("Host allocation of %zu bytes (%s scope) inside the frame loop", size,
+                  scope < HOST_ALLOCATION_SCOPES ? HOST_ALLOCATION_SCOPE_STR[scope] : "Unknown");
+        }
+    }
+}
+
+static VKAPI_ATTR void* VKAPI_CALL vulkan_host_alloc(void* userData, size_t size, size_t alignment, VkSystemAllocationScope scope) {
+    if (!size) {
+        return 0;
+    }
+
+    // NOTE: alignment is a power of two, at least pointer sized keeps the header aligned too
+    alignment = alignment < sizeof(void*) ? sizeof(void*) : alignment;
+    void* block = malloc(sizeof(HostAllocationHeader) + alignment - 1 + size);
+    if (!block) {
+        return 0;
+    }
+    uintptr_t address = ((uintptr_t)block + sizeof(HostAllocationHeader) + alignment - 1) & ~(uintptr_t)(alignment - 1);
+    HostAllocationHeader* header = (HostAllocationHeader*)address - 1;
+    header->block = block;
+    header->size = size;
+    header->scope = scope;
+
+    vulkan_host_track(userData, size, scope);
+    return (void*)address;
+}
+
+static VKAPI_ATTR void VKAPI_CALL vulkan_host_free(void* userData, void* memory) {
+    if (!memory) {
+        return;
+    }
+    HostAllocator* allocator = userData;
+    HostAllocationHeader* header = (HostAllocationHeader*)memory - 1;
+    if (header->scope < HOST_ALLOCATION_SCOPES) {
+        atomic_fetch_sub_explicit(&allocator->scopes[header->scope].live, header->size, memory_order_relaxed);
+    }
+    free(header->block);
+}
+
+static VKAPI_ATTR void* VKAPI_CALL vulkan_host_realloc(void* userData, void* original, size_t size, size_t alignment, VkSystemAllocationScope scope) {
+    if (!original) {
+        return vulkan_host_alloc(userData, size, alignment, scope);
+    }
+    if (!size) {
+        vulkan_host_free(userData, original);
+        return 0;
+    }
+
+    // NOTE: a fresh block keeps the alignment guarantee, the original stays valid when this fails
+    HostAllocationHeader* header = (HostAllocationHeader*)original - 1;
+    void* memory = vulkan_host_alloc(userData, size, alignment, scope);
+    if (memory) {
+        memcpy(memory, original, header->size < size ? header->size : size);
+        vulkan_host_free(userData, original);
+    }
+    return memory;
+}
+
+static VKAPI_ATTR void VKAPI_CALL vulkan_host_internal_alloc(void* userData, size_t size, VkInternalAllocationType type, VkSystemAllocationScope scope) {
+    HostAllocator* allocator = userData;
+    if (scope < HOST_ALLOCATION_SCOPES) {
+        atomic_fetch_add_explicit(&allocator->scopes[scope].internal, size, memory_order_relaxed);
+    }
+}
+
+static VKAPI_ATTR void VKAPI_CALL vulkan_host_internal_free(void* userData, size_t size, VkInternalAllocationType type, VkSystemAllocationScope scope) {
+    HostAllocator* allocator = userData;
+    if (scope < HOST_ALLOCATION_SCOPES) {
+        atomic_fetch_sub_explicit(&allocator->scopes[scope].internal, size, memory_order_relaxed);
+    }
+}
+#endif
+
+// NOTE: called on the render thread before the instance exists, everything created afterwards uses vulkan->allocator
+static void vulkan_host_allocator_init(VulkanState* vulkan) {
+#if TRACK_HOST_ALLOCATIONS
+    HostAllocator* allocator = &vulkan->hostAllocator;
+    allocator->callbacks = (VkAllocationCallbacks){
+        .pUserData = allocator,
+        .pfnAllocation = vulkan_host_alloc,
+        .pfnReallocation = vulkan_host_realloc,
+        .pfnFree = vulkan_host_free,
+        .pfnInternalAllocation = vulkan_host_internal_alloc,
+        .pfnInternalFree = vulkan_host_internal_free};
+    allocator->frameThread = pthread_self();
+    vulkan->allocator = &allocator->callbacks;
+#endif
+}
+
+static void vulkan_host_allocator_frame(VulkanState* vulkan, bool inFrame) {
+    atomic_store_explicit(&vulkan->hostAllocator.inFrame, inFrame, memory_order_relaxed);
+}
+
+static void vulkan_host_allocator_report(VulkanState* vulkan, const char* reason) {
+    if (!vulkan->allocator) {
+        return;
+    }
+    HostAllocator* allocator = &vulkan->hostAllocator;
+    double kb = 1024.0;
+    CINFO("Host memory (%s): %llu allocations, %.2f KB inside the frame loop", reason,
+          (unsigned long long)atomic_load(&allocator->frameAllocations), atomic_load(&allocator->frameBytes) / kb);
+    for (uint32_t i = 0; i < HOST_ALLOCATION_SCOPES; ++i) {
+        HostAllocationScope* stats = &allocator->scopes[i];
+        CINFO("  %-9s %8llu allocations, live %8.2f KB, peak %8.2f KB, internal %8.2f KB", HOST_ALLOCATION_SCOPE_STR[i],
+              (unsigned long long)atomic_load(&stats->count), atomic_load(&stats->live) / kb,
+              atomic_load(&stats->peak) / kb, atomic_load(&stats->internal) / kb);
+    }
+}
+
+static bool vulkan_commandbuffer_init(VulkanState* vulkan, uint32_t queueFamily, CmdBuffer* cbr) {
     VkCommandPoolCreateInfo commandPoolCI = {
         .sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
         .flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT,
         .queueFamilyIndex = queueFamily};
 
-    VkResult result = vkCreateCommandPool(device, &commandPoolCI, 0, &cbr->pool);
+    VkResult result = vkCreateCommandPool(vulkan->device, &commandPoolCI, vulkan->allocator, &cbr->pool);
     CHECKVK(result, "Failed to create command pool");
 
     VkCommandBufferAllocateInfo cbrAI = {
@@ -638,19 +1234,159 @@ static bool vulkan_commandbuffer_init(VkDevice device, uint32_t queueFamily, Cmd
         .level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
         .commandBufferCount = 1};
 
-    result = vkAllocateCommandBuffers(device, &cbrAI, &cbr->buf);
+    result = vkAllocateCommandBuffers(vulkan->device, &cbrAI, &cbr->buf);
     CHECKVK(result, "Failed to allocate command buffer");
 
     VkFenceCreateInfo fenceCI = {
         .sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO};
-    result = vkCreateFence(device, &fenceCI, 0, &cbr->execFence);
+    result = vkCreateFence(vulkan->device, &fenceCI, vulkan->allocator, &cbr->execFence);
     CHECKVK(result, "Failed to allocate command buffer execution fence");
 
     cbr->state = CBR_STATE_Initialized;
     return true;
 }
 
-static bool vulkan_buffer_allocate(VkDevice device, VkMemoryRequirements memReq, VkPhysicalDeviceMemoryProperties* deviceMem, VkFlags flags, VkDeviceMemory* out) {
+static bool vulkan_gpu_timer_init(VulkanState* vulkan) {
+    if (!vulkan->caps.timestamps) {
+        return true;
+    }
+
+    VkQueryPoolCreateInfo poolCI = {
+        .sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO,
+        .queryType = VK_QUERY_TYPE_TIMESTAMP,
+        .queryCount = NUM_VIEWES * 2};
+    VkResult result = vkCreateQueryPool(vulkan->device, &poolCI, vulkan->allocator, &vulkan->gpuTimer.pool);
+    CHECKVK(result, "Failed to create timestamp query pool");
+    return true;
+}
+
+static void vulkan_gpu_timer_begin(VulkanState* vulkan, VkCommandBuffer cmd, uint32_t view) {
+    if (vulkan->gpuTimer.pool) {
+        vkCmdResetQueryPool(cmd, vulkan->gpuTimer.pool, view * 2, 2);
+        vkCmdWriteTimestamp(cmd, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, vulkan->gpuTimer.pool, view * 2);
+    }
+}
+
+static void vulkan_gpu_timer_end(VulkanState* vulkan, VkCommandBuffer cmd, uint32_t view) {
+    if (vulkan->gpuTimer.pool) {
+        vkCmdWriteTimestamp(cmd, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, vulkan->gpuTimer.pool, view * 2 + 1);
+    }
+}
+
+// NOTE: the views were waited on already, so the results are there, returns 0 when they aren't
+static uint64_t vulkan_gpu_timer_read(VulkanState* vulkan, uint32_t viewCount) {
+    if (!vulkan->gpuTimer.pool) {
+        return 0;
+    }
+
+    uint64_t stamps[NUM_VIEWES * 2];
+    VkResult result = vkGetQueryPoolResults(vulkan->device, vulkan->gpuTimer.pool, 0, viewCount * 2, sizeof(stamps), stamps, sizeof(uint64_t), VK_QUERY_RESULT_64_BIT);
+    if (result != VK_SUCCESS) {
+        return 0;
+    }
+
+    uint64_t ticks = 0;
+    for (uint32_t i = 0; i < viewCount; ++i) {
+        ticks += ((stamps[i * 2 + 1] & vulkan->gpuTimer.mask) - (stamps[i * 2] & vulkan->gpuTimer.mask)) & vulkan->gpuTimer.mask;
+    }
+    return (uint64_t)(ticks * (double)vulkan->limits.timestampPeriod);
+}
+
+static bool vulkan_frame_sync_init(VulkanState* vulkan) {
+    vulkan->frameSync.submitted = 0;
+    vulkan->frameSync.completed = 0;
+    if (!vulkan->caps.timelineSemaphore) {
+        CINFO("Timeline semaphores not supported, frame sync falls back to fences");
+        return true;
+    }
+
+    VkSemaphoreTypeCreateInfoKHR typeCI = {
+        .sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO_KHR,
+        .semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE_KHR,
+        .initialValue = 0};
+    VkSemaphoreCreateInfo semaphoreCI = {
+        .sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO,
+        .pNext = &typeCI};
+    VkResult result = vkCreateSemaphore(vulkan->device, &semaphoreCI, vulkan->allocator, &vulkan->frameSync.timeline);
+    CHECKVK(result, "Failed to create frame sync timeline semaphore");
+    return true;
+}
+
+static void vulkan_memory_query_budget(VulkanState* vulkan) {
+    MemoryTracker* tracker = &vulkan->memory;
+    tracker->lastQuery = time_now_ns();
+#if defined(VK_EXT_memory_budget)
+    if (vulkan->caps.memoryBudget) {
+        VkPhysicalDeviceMemoryBudgetPropertiesEXT budget = {
+            .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MEMORY_BUDGET_PROPERTIES_EXT};
+        VkPhysicalDeviceMemoryProperties2 props2 = {
+            .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MEMORY_PROPERTIES_2,
+            .pNext = &budget};
+        vkGetPhysicalDeviceMemoryProperties2(vulkan->physical, &props2);
+        for (uint32_t i = 0; i < vulkan->memProps.memoryHeapCount; ++i) {
+            tracker->heapUsage[i] = budget.heapUsage[i];
+            tracker->heapBudget[i] = budget.heapBudget[i];
+        }
+        return;
+    }
+#endif
+    for (uint32_t i = 0; i < vulkan->memProps.memoryHeapCount; ++i) {
+        tracker->heapUsage[i] = tracker->heapAllocated[i];
+        tracker->heapBudget[i] = vulkan->memProps.memoryHeaps[i].size;
+    }
+}
+
+static void vulkan_memory_report(VulkanState* vulkan, const char* reason) {
+    MemoryTracker* tracker = &vulkan->memory;
+    double mb = 1024.0 * 1024.0;
+    CINFO("GPU memory (%s): %.2f MB in %u allocations, peak %.2f MB", reason,
+          tracker->total / mb, tracker->allocationCount, tracker->peak / mb);
+    for (uint32_t i = 0; i < MEMORY_CATEGORY_COUNT; ++i) {
+        CINFO("  %-12s %8.2f MB", MEMORY_CATEGORY_STR[i], tracker->category[i] / mb);
+    }
+    for (uint32_t i = 0; i < vulkan->memProps.memoryHeapCount; ++i) {
+        CINFO("  Heap %u%s: ours %.2f MB, process %.2f MB, budget %.2f MB%s", i,
+              (vulkan->memProps.memoryHeaps[i].flags & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT) ? " (device local)" : "",
+              tracker->heapAllocated[i] / mb, tracker->heapUsage[i] / mb, tracker->heapBudget[i] / mb,
+              vulkan->caps.memoryBudget ? "" : " (heap size, no budget extension)");
+    }
+}
+
+// NOTE: warns once per threshold crossed, and again after the heap dropped back below it
+static void vulkan_memory_check(VulkanState* vulkan) {
+    MemoryTracker* tracker = &vulkan->memory;
+    bool critical = false;
+    for (uint32_t i = 0; i < vulkan->memProps.memoryHeapCount; ++i) {
+        if (!tracker->heapBudget[i]) {
+            continue;
+        }
+        uint32_t percent = (uint32_t)(tracker->heapUsage[i] * 100 / tracker->heapBudget[i]);
+        uint32_t level = percent >= MEMORY_CRITICAL_PERCENT ? 2 : percent >= MEMORY_WARN_PERCENT ? 1 : 0;
+        if (level > tracker->heapLevel[i]) {
+            CWARN("Heap %u at %u%% of its budget (%llu of %llu bytes)", i, percent,
+                  (unsigned long long)tracker->heapUsage[i], (unsigned long long)tracker->heapBudget[i]);
+            critical |= level == 2;
+        } else if (level < tracker->heapLevel[i]) {
+            CINFO("Heap %u back to %u%% of its budget", i, percent);
+        }
+        tracker->heapLevel[i] = level;
+    }
+    if (critical) {
+        vulkan_memory_report(vulkan, "critical");
+    }
+}
+
+// NOTE: once per frame, refreshes the budget every MEMORY_BUDGET_INTERVAL_NS
+static void vulkan_memory_update(VulkanState* vulkan) {
+    if (time_now_ns() - vulkan->memory.lastQuery < MEMORY_BUDGET_INTERVAL_NS) {
+        return;
+    }
+    vulkan_memory_query_budget(vulkan);
+    vulkan_memory_check(vulkan);
+}
+
+static bool vulkan_buffer_allocate(VulkanState* vulkan, VkMemoryRequirements memReq, VkFlags flags, MemoryCategory category, VkDeviceMemory* out) {
+    VkPhysicalDeviceMemoryProperties* deviceMem = &vulkan->memProps;
     for (uint32_t i = 0; i < deviceMem->memoryTypeCount; ++i) {
         if ((memReq.memoryTypeBits & (1 << i)) != 0u) {
             // Type is available, does it match user properties?
@@ -660,30 +1396,77 @@ static bool vulkan_buffer_allocate(VkDevice device, VkMemoryRequirements memReq,
                     .allocationSize = memReq.size,
                     .memoryTypeIndex = i};
 
-                VkResult result = vkAllocateMemory(device, &memoryAI, 0, out);
-                return result == VK_SUCCESS;
+                VkResult result = vkAllocateMemory(vulkan->device, &memoryAI, vulkan->allocator, out);
+                if (result == VK_ERROR_OUT_OF_DEVICE_MEMORY || result == VK_ERROR_OUT_OF_HOST_MEMORY) {
+                    CWARN("Out of memory allocating %llu bytes of %s", (unsigned long long)memReq.size, MEMORY_CATEGORY_STR[category]);
+                    vulkan_memory_query_budget(vulkan);
+                    vulkan_memory_report(vulkan, "allocation failed");
+                }
+                if (result != VK_SUCCESS) {
+                    return false;
+                }
+
+                MemoryTracker* tracker = &vulkan->memory;
+                uint32_t heap = deviceMem->memoryTypes[i].heapIndex;
+                if (tracker->allocationCount < MAX_MEMORY_ALLOCATIONS) {
+                    tracker->allocations[tracker->allocationCount++] = (MemoryAllocation){
+                        .memory = *out,
+                        .size = memReq.size,
+                        .heap = heap,
+                        .category = category};
+                } else {
+                    CWARN("Memory tracker full, %llu bytes of %s untracked", (unsigned long long)memReq.size, MEMORY_CATEGORY_STR[category]);
+                    return true;
+                }
+                tracker->category[category] += memReq.size;
+                tracker->heapAllocated[heap] += memReq.size;
+                tracker->total += memReq.size;
+                tracker->peak = tracker->total > tracker->peak ? tracker->total : tracker->peak;
+                return true;
             }
         }
     }
     return false;
 }
 
-static bool vulkan_vertex_buffer_create(VkDevice device, VkPhysicalDeviceMemoryProperties* deviceMem, uint32_t indexCount, uint32_t vertexCount, VertexBuffer* buf) {
+static void vulkan_memory_free(VulkanState* vulkan, VkDeviceMemory* memory) {
+    if (!*memory) {
+        return;
+    }
+
+    MemoryTracker* tracker = &vulkan->memory;
+    for (uint32_t i = 0; i < tracker->allocationCount; ++i) {
+        MemoryAllocation* allocation = &tracker->allocations[i];
+        if (allocation->memory != *memory) {
+            continue;
+        }
+        tracker->category[allocation->category] -= allocation->size;
+        tracker->heapAllocated[allocation->heap] -= allocation->size;
+        tracker->total -= allocation->size;
+        *allocation = tracker->allocations[--tracker->allocationCount];
+        break;
+    }
+    vkFreeMemory(vulkan->device, *memory, vulkan->allocator);
+    *memory = VK_NULL_HANDLE;
+}
+
+static bool vulkan_vertex_buffer_create(VulkanState* vulkan, uint32_t indexCount, uint32_t vertexCount, VertexBuffer* buf) {
+    VkDevice device = vulkan->device;
     VkBufferCreateInfo bufferCI = {
         .sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
-        .usage = VK_BUFFER_USAGE_INDEX_BUFFER_BIT,
+        .usage = VK_BUFFER_USAGE_INDEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
         .size = sizeof(uint16_t) * indexCount};
-    VkResult result = vkCreateBuffer(device, &bufferCI, 0, &buf->idxBuf);
+    VkResult result = vkCreateBuffer(device, &bufferCI, vulkan->allocator, &buf->idxBuf);
     CHECKVK(result, "Failed to craete index buffer");
 
     {
         VkMemoryRequirements memReq = {};
         vkGetBufferMemoryRequirements(device, buf->idxBuf, &memReq);
         if (!vulkan_buffer_allocate(
-                device,
+                vulkan,
                 memReq,
-                deviceMem,
-                VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                MEMORY_Geometry,
                 &buf->idxMem)) {
             CERROR("Failed to allocate index buffer memory");
             return false;
@@ -693,19 +1476,19 @@ static bool vulkan_vertex_buffer_create(VkDevice device, VkPhysicalDeviceMemoryP
     result = vkBindBufferMemory(device, buf->idxBuf, buf->idxMem, 0);
     CHECKVK(result, "Failed to bind index buffer memory");
 
-    bufferCI.usage = VK_BUFFER_USAGE_VERTEX_BUFFER_BIT;
+    bufferCI.usage = VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT;
     bufferCI.size = sizeof(Vertex) * vertexCount;
-    result = vkCreateBuffer(device, &bufferCI, 0, &buf->vtxBuf);
+    result = vkCreateBuffer(device, &bufferCI, vulkan->allocator, &buf->vtxBuf);
     CHECKVK(result, "Failed to craete vertex buffer");
 
     {
         VkMemoryRequirements memReq = {};
         vkGetBufferMemoryRequirements(device, buf->vtxBuf, &memReq);
         if (!vulkan_buffer_allocate(
-                device,
+                vulkan,
                 memReq,
-                deviceMem,
-                VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                MEMORY_Geometry,
                 &buf->vtxMem)) {
             CERROR("Failed to allocate vertex buffer memory");
             return false;
@@ -724,96 +1507,565 @@ static bool vulkan_vertex_buffer_create(VkDevice device, VkPhysicalDeviceMemoryP
     return true;
 }
 
-static bool vulkan_buffer_update(VkDevice device, VkDeviceMemory mem, size_t size, void* data) {
-    void* map = 0;
-    VkResult result = vkMapMemory(device, mem, 0, size, 0, &map);
-    CHECKVK(result, "Failed to map memory");
-    memcpy(map, data, size);
-    vkUnmapMemory(device, mem);
-    return true;
-}
-
-static bool vulkan_initialize_resources(VulkanState* vulkan) {
-    vulkan->shaderProgram[0] = (VkPipelineShaderStageCreateInfo){
-        .sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
-        .pName = "main",
-        .stage = VK_SHADER_STAGE_VERTEX_BIT,
-    };
+// NOTE: queue family ownership transfer of an exclusive resource, the release is recorded on the source queue and
+//       the acquire on the destination, a semaphore between the two submissions orders them.
+//       Within one family the release records a plain barrier and the acquire does nothing.
+//       Only buffers change queues so far, the layouts of the states are ignored.
+static void vulkan_ownership_barrier(VkCommandBuffer cmd, VkBuffer buffer, ImageState src, ImageState dst, uint32_t srcFamily, uint32_t dstFamily, bool release) {
+    bool transfer = srcFamily != dstFamily;
+    if (!transfer && !release) {
+        return;
+    }
 
-    VkShaderModuleCreateInfo moduleCI = {
-        .sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO,
-        .pCode = vertSpv,
-        .codeSize = sizeof(vertSpv)};
-    VkResult result = vkCreateShaderModule(vulkan->device, &moduleCI, 0, &vulkan->shaderProgram[0].module);
-    CHECKVK(result, "Failed to create Vertex shader");
+    // NOTE: the release half makes the writes available, the acquire half makes them visible
+    VkPipelineStageFlags srcStage = release ? (VkPipelineStageFlags)src.stage : VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT;
+    VkPipelineStageFlags dstStage = release && transfer ? VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT : (VkPipelineStageFlags)dst.stage;
+    VkAccessFlags srcAccess = release ? (VkAccessFlags)(src.access & ACCESS_WRITE_MASK) : 0;
+    VkAccessFlags dstAccess = release && transfer ? 0 : (VkAccessFlags)dst.access;
+    uint32_t srcQueue = transfer ? srcFamily : VK_QUEUE_FAMILY_IGNORED;
+    uint32_t dstQueue = transfer ? dstFamily : VK_QUEUE_FAMILY_IGNORED;
+
+    VkBufferMemoryBarrier barrier = {
+        .sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER,
+        .srcAccessMask = srcAccess,
+        .dstAccessMask = dstAccess,
+        .srcQueueFamilyIndex = srcQueue,
+        .dstQueueFamilyIndex = dstQueue,
+        .buffer = buffer,
+        .offset = 0,
+        .size = VK_WHOLE_SIZE};
+    vkCmdPipelineBarrier(cmd, srcStage ? srcStage : VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, dstStage ? dstStage : VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0, 0, 0, 1, &barrier, 0, 0);
+}
 
-    vulkan->shaderProgram[1] = (VkPipelineShaderStageCreateInfo){
-        .sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
-        .pName = "main",
-        .stage = VK_SHADER_STAGE_FRAGMENT_BIT,
-    };
+static void vulkan_buffer_release(VkCommandBuffer cmd, VkBuffer buffer, ImageState src, ImageState dst, uint32_t srcFamily, uint32_t dstFamily) {
+    vulkan_ownership_barrier(cmd, buffer, src, dst, srcFamily, dstFamily, true);
+}
 
-    moduleCI.pCode = fragSpv;
-    moduleCI.codeSize = sizeof(fragSpv);
-    result = vkCreateShaderModule(vulkan->device, &moduleCI, 0, &vulkan->shaderProgram[1].module);
-    CHECKVK(result, "Failed to create Fragment shader");
+static void vulkan_buffer_acquire(VkCommandBuffer cmd, VkBuffer buffer, ImageState src, ImageState dst, uint32_t srcFamily, uint32_t dstFamily) {
+    vulkan_ownership_barrier(cmd, buffer, src, dst, srcFamily, dstFamily, false);
+}
 
-    if (!vulkan_commandbuffer_init(vulkan->device, vulkan->queueFamilyIndex, &vulkan->cmdBuffer)) {
-        CERROR("Failed to initialize commandbuffer");
-        return false;
+static bool vulkan_upload_chunk(VulkanState* vulkan, UploadJob* job, VkDeviceSize offset, VkDeviceSize size) {
+    UploadService* upload = &vulkan->upload;
+    memcpy(upload->stagingMapped, (const uint8_t*)job->data + offset, size);
+
+    VkCommandBufferBeginInfo beginInfo = {
+        .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+        .flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT};
+    VkResult result = vkBeginCommandBuffer(upload->cmd, &beginInfo);
+    CHECKVK(result, "Failed to begin upload command buffer");
+
+    VkBufferCopy region = {
+        .srcOffset = 0,
+        .dstOffset = offset,
+        .size = size};
+    vkCmdCopyBuffer(upload->cmd, upload->staging, job->dst, 1, &region);
+    if (offset + size == job->size) {
+        // NOTE: the barrier's first scope covers the earlier chunks too, they went through the same queue
+        ImageState written = {
+            .stage = VK_PIPELINE_STAGE_TRANSFER_BIT,
+            .access = VK_ACCESS_TRANSFER_WRITE_BIT};
+        vulkan_buffer_release(upload->cmd, job->dst, written, job->dstState, vulkan->transfer.family, vulkan->queueFamilyIndex);
+    }
+    result = vkEndCommandBuffer(upload->cmd);
+    CHECKVK(result, "Failed to end upload command buffer");
+
+    result = vkResetFences(vulkan->device, 1, &upload->fence);
+    CHECKVK(result, "Failed to reset upload fence");
+
+    if (vulkan->transfer.shared) {
+        pthread_mutex_lock(&upload->lock);
+        upload->recorded = true;
+        upload->submitFailed = false;
+        while ((upload->recorded || upload->inFlight) && !upload->quit) {
+            pthread_cond_wait(&upload->wake, &upload->lock);
+        }
+        bool submitted = !upload->submitFailed && !upload->quit;
+        pthread_mutex_unlock(&upload->lock);
+        return submitted;
     }
 
-    {
-        VkPushConstantRange pcr = {
-            .offset = 0,
-            .size = 4 * 4 * sizeof(float),
-            .stageFlags = VK_SHADER_STAGE_VERTEX_BIT};
+    VkSubmitInfo submitInfo = {
+        .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
+        .commandBufferCount = 1,
+        .pCommandBuffers = &upload->cmd};
+    result = vkQueueSubmit(vulkan->transfer.queue, 1, &submitInfo, upload->fence);
+    CHECKVK(result, "Failed to submit upload");
+    result = vkWaitForFences(vulkan->device, 1, &upload->fence, VK_TRUE, GPU_WAIT_TIMEOUT_NS);
+    CHECKVK(result, "Failed to wait for upload");
+    return true;
+}
 
-        VkPipelineLayoutCreateInfo pipelineLayoutCI = {
-            .sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO,
-            .pushConstantRangeCount = 1,
-            .pPushConstantRanges = &pcr};
+static void* vulkan_upload_worker(void* arg) {
+    VulkanState* vulkan = (VulkanState*)arg;
+    UploadService* upload = &vulkan->upload;
 
-        VkResult result = vkCreatePipelineLayout(vulkan->device, &pipelineLayoutCI, 0, &vulkan->pipelineLayout);
-        CHECKVK(result, "Failed to create pipeline layout");
+    pthread_mutex_lock(&upload->lock);
+    for (;;) {
+        while (upload->head == upload->tail && !upload->quit) {
+            pthread_cond_wait(&upload->wake, &upload->lock);
+        }
+        if (upload->quit) {
+            break;
+        }
+        UploadJob* job = &upload->jobs[upload->queue[upload->head++ % MAX_UPLOADS]];
+        pthread_mutex_unlock(&upload->lock);
+
+        uint64_t start = time_now_ns();
+        bool uploaded = true;
+        for (VkDeviceSize offset = 0; uploaded && offset < job->size; offset += UPLOAD_STAGING_SIZE) {
+            VkDeviceSize size = job->size - offset < UPLOAD_STAGING_SIZE ? job->size - offset : UPLOAD_STAGING_SIZE;
+            uploaded = vulkan_upload_chunk(vulkan, job, offset, size);
+        }
+
+        pthread_mutex_lock(&upload->lock);
+        upload->uploaded += uploaded ? job->size : 0;
+        atomic_store_explicit(&job->state, uploaded ? UPLOAD_Transferred : UPLOAD_Failed, memory_order_release);
+        CINFO("Upload of %llu bytes %s in %.3f ms", (unsigned long long)job->size,
+              uploaded ? "copied" : "failed", (time_now_ns() - start) / 1000000.0);
     }
+    pthread_mutex_unlock(&upload->lock);
+    return 0;
+}
 
-    vulkan->drawBuffer.attrDesc[0] = (VkVertexInputAttributeDescription){
-        .location = 0,
-        .binding = 0,
-        .format = VK_FORMAT_R32G32B32_SFLOAT,
-        .offset = offsetof(Vertex, pos)};
+static bool vulkan_upload_init(VulkanState* vulkan) {
+    UploadService* upload = &vulkan->upload;
+    VkCommandPoolCreateInfo poolCI = {
+        .sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
+        .flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT | VK_COMMAND_POOL_CREATE_TRANSIENT_BIT,
+        .queueFamilyIndex = vulkan->transfer.family};
+    VkResult result = vkCreateCommandPool(vulkan->device, &poolCI, vulkan->allocator, &upload->pool);
+    CHECKVK(result, "Failed to create upload command pool");
 
-    vulkan->drawBuffer.attrDesc[1] = (VkVertexInputAttributeDescription){
-        .location = 1,
-        .binding = 0,
-        .format = VK_FORMAT_R32G32B32_SFLOAT,
-        .offset = offsetof(Vertex, color)};
+    VkCommandBufferAllocateInfo cmdAI = {
+        .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+        .commandPool = upload->pool,
+        .level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
+        .commandBufferCount = 1};
+    result = vkAllocateCommandBuffers(vulkan->device, &cmdAI, &upload->cmd);
+    CHECKVK(result, "Failed to allocate upload command buffer");
 
-    uint32_t indexCount = array_size(cubeIndices);
-    uint32_t vertexCount = array_size(cubeVertices);
+    VkFenceCreateInfo fenceCI = {
+        .sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO};
+    result = vkCreateFence(vulkan->device, &fenceCI, vulkan->allocator, &upload->fence);
+    CHECKVK(result, "Failed to create upload fence");
 
-    if (!vulkan_vertex_buffer_create(vulkan->device, &vulkan->memProps, indexCount, vertexCount, &vulkan->drawBuffer)) {
-        CERROR("Failed to create buffers");
-        return false;
-    }
+    VkBufferCreateInfo bufferCI = {
+        .sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
+        .usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+        .size = UPLOAD_STAGING_SIZE};
+    result = vkCreateBuffer(vulkan->device, &bufferCI, vulkan->allocator, &upload->staging);
+    CHECKVK(result, "Failed to create upload staging buffer");
 
-    if (!vulkan_buffer_update(vulkan->device, vulkan->drawBuffer.idxMem, sizeof(uint16_t) * indexCount, (void*)cubeIndices)) {
-        CERROR("Failed to update index buffer");
+    VkMemoryRequirements memReq = {};
+    vkGetBufferMemoryRequirements(vulkan->device, upload->staging, &memReq);
+    if (!vulkan_buffer_allocate(
+            vulkan,
+            memReq,
+            VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+            MEMORY_Staging,
+            &upload->stagingMem)) {
+        CERROR("Failed to allocate upload staging memory");
         return false;
     }
-
-    if (!vulkan_buffer_update(vulkan->device, vulkan->drawBuffer.vtxMem, sizeof(Vertex) * vertexCount, (void*)cubeVertices)) {
-        CERROR("Failed to update vertex buffer");
+    result = vkBindBufferMemory(vulkan->device, upload->staging, upload->stagingMem, 0);
+    CHECKVK(result, "Failed to bind upload staging memory");
+    result = vkMapMemory(vulkan->device, upload->stagingMem, 0, VK_WHOLE_SIZE, 0, (void**)&upload->stagingMapped);
+    CHECKVK(result, "Failed to map upload staging memory");
+
+    pthread_mutex_init(&upload->lock, 0);
+    pthread_cond_init(&upload->wake, 0);
+    if (pthread_create(&upload->worker, 0, vulkan_upload_worker, vulkan)) {
+        CERROR("Failed to start the upload worker");
+        pthread_cond_destroy(&upload->wake);
+        pthread_mutex_destroy(&upload->lock);
         return false;
     }
-
+    upload->started = true;
     return true;
 }
 
-static bool vulkan_find_layer(const char* layer) {
-    uint32_t layerCount;
-    VkResult result = vkEnumerateInstanceLayerProperties(&layerCount, 0);
+static void vulkan_upload_shutdown(VulkanState* vulkan) {
+    UploadService* upload = &vulkan->upload;
+    if (upload->started) {
+        pthread_mutex_lock(&upload->lock);
+        upload->quit = true;
+        pthread_cond_broadcast(&upload->wake);
+        pthread_mutex_unlock(&upload->lock);
+        pthread_join(upload->worker, 0);
+        pthread_cond_destroy(&upload->wake);
+        pthread_mutex_destroy(&upload->lock);
+        upload->started = false;
+        CINFO("Upload service: %llu bytes uploaded", (unsigned long long)upload->uploaded);
+    }
+}
+
+// NOTE: render thread only, the slot stays taken once the job is done
+static UploadJob* vulkan_upload_request(VulkanState* vulkan, VkBuffer dst, const void* data, VkDeviceSize size, ImageState dstState) {
+    UploadService* upload = &vulkan->upload;
+    for (uint32_t i = 0; i < MAX_UPLOADS; ++i) {
+        UploadJob* job = &upload->jobs[i];
+        if (atomic_load_explicit(&job->state, memory_order_acquire) != UPLOAD_Free) {
+            continue;
+        }
+
+        job->dst = dst;
+        job->data = data;
+        job->size = size;
+        job->dstState = dstState;
+        atomic_store_explicit(&job->state, UPLOAD_Queued, memory_order_relaxed);
+        pthread_mutex_lock(&upload->lock);
+        upload->queue[upload->tail++ % MAX_UPLOADS] = i;
+        pthread_cond_broadcast(&upload->wake);
+        pthread_mutex_unlock(&upload->lock);
+        return job;
+    }
+
+    CERROR("Upload queue is full (%u jobs)", MAX_UPLOADS);
+    return 0;
+}
+
+static bool vulkan_upload_ready(UploadJob* job) {
+    return job && atomic_load_explicit(&job->state, memory_order_acquire) == UPLOAD_Ready;
+}
+
+// NOTE: render thread, submits a chunk recorded for the shared queue and notices when it finished
+static bool vulkan_upload_pump(VulkanState* vulkan) {
+    UploadService* upload = &vulkan->upload;
+    if (!upload->started || !vulkan->transfer.shared) {
+        return true;
+    }
+
+    bool submitted = true;
+    pthread_mutex_lock(&upload->lock);
+    if (upload->inFlight && vkGetFenceStatus(vulkan->device, upload->fence) == VK_SUCCESS) {
+        upload->inFlight = false;
+        pthread_cond_broadcast(&upload->wake);
+    }
+    if (upload->recorded && !upload->inFlight) {
+        VkSubmitInfo submitInfo = {
+            .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
+            .commandBufferCount = 1,
+            .pCommandBuffers = &upload->cmd};
+        VkResult result = vkQueueSubmit(vulkan->transfer.queue, 1, &submitInfo, upload->fence);
+        upload->recorded = false;
+        upload->inFlight = result == VK_SUCCESS;
+        upload->submitFailed = result != VK_SUCCESS;
+        submitted = result == VK_SUCCESS;
+        pthread_cond_broadcast(&upload->wake);
+    }
+    pthread_mutex_unlock(&upload->lock);
+    if (!submitted) {
+        CERROR("Failed to submit upload on the shared queue");
+        return false;
+    }
+    return true;
+}
+
+// NOTE: recorded into the first graphics command buffer of the frame, before anything reads the buffers
+static void vulkan_upload_acquire(VulkanState* vulkan, VkCommandBuffer cmd) {
+    UploadService* upload = &vulkan->upload;
+    for (uint32_t i = 0; i < MAX_UPLOADS; ++i) {
+        UploadJob* job = &upload->jobs[i];
+        if (atomic_load_explicit(&job->state, memory_order_acquire) != UPLOAD_Transferred) {
+            continue;
+        }
+        ImageState written = {
+            .stage = VK_PIPELINE_STAGE_TRANSFER_BIT,
+            .access = VK_ACCESS_TRANSFER_WRITE_BIT};
+        vulkan_buffer_acquire(cmd, job->dst, written, job->dstState, vulkan->transfer.family, vulkan->queueFamilyIndex);
+        atomic_store_explicit(&job->state, UPLOAD_Ready, memory_order_relaxed);
+    }
+}
+
+static bool vulkan_frame_ring_init(VulkanState* vulkan, VkDeviceSize regionSize, FrameRing* ring) {
+    VkDeviceSize alignment = 1;
+    alignment = vulkan->limits.minUniformBufferOffsetAlignment > alignment ? vulkan->limits.minUniformBufferOffsetAlignment : alignment;
+    alignment = vulkan->limits.minStorageBufferOffsetAlignment > alignment ? vulkan->limits.minStorageBufferOffsetAlignment : alignment;
+    alignment = vulkan->limits.nonCoherentAtomSize > alignment ? vulkan->limits.nonCoherentAtomSize : alignment;
+    ring->alignment = alignment;
+    ring->regionSize = (regionSize + alignment - 1) & ~(alignment - 1);
+
+    VkBufferCreateInfo bufferCI = {
+        .sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
+        .usage = VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
+                 VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_INDEX_BUFFER_BIT,
+        .size = ring->regionSize * FRAMES_IN_FLIGHT};
+    VkResult result = vkCreateBuffer(vulkan->device, &bufferCI, vulkan->allocator, &ring->buf);
+    CHECKVK(result, "Failed to create frame ring buffer");
+
+    VkMemoryRequirements memReq = {};
+    vkGetBufferMemoryRequirements(vulkan->device, ring->buf, &memReq);
+    ring->coherent = vulkan_buffer_allocate(
+        vulkan,
+        memReq,
+        VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+        MEMORY_Staging,
+        &ring->mem);
+    if (!ring->coherent && !vulkan_buffer_allocate(
+                               vulkan,
+                               memReq,
+                               VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT,
+                               MEMORY_Staging,
+                               &ring->mem)) {
+        CERROR("Failed to allocate frame ring memory");
+        return false;
+    }
+
+    result = vkBindBufferMemory(vulkan->device, ring->buf, ring->mem, 0);
+    CHECKVK(result, "Failed to bind frame ring memory");
+
+    result = vkMapMemory(vulkan->device, ring->mem, 0, VK_WHOLE_SIZE, 0, (void**)&ring->mapped);
+    CHECKVK(result, "Failed to map frame ring memory");
+
+    ring->region = 0;
+    ring->head = 0;
+    CINFO("Frame ring: %u x %llu bytes, alignment %llu, %s",
+          FRAMES_IN_FLIGHT, (unsigned long long)ring->regionSize, (unsigned long long)ring->alignment,
+          ring->coherent ? "coherent" : "explicit flushes");
+    return true;
+}
+
+static bool vulkan_frame_ring_alloc(FrameRing* ring, VkDeviceSize size, RingAllocation* out) {
+    VkDeviceSize offset = (ring->head + ring->alignment - 1) & ~(ring->alignment - 1);
+    if (offset + size > ring->regionSize) {
+        CERROR("Frame ring region full: %llu + %llu > %llu",
+               (unsigned long long)offset, (unsigned long long)size, (unsigned long long)ring->regionSize);
+        return false;
+    }
+    ring->head = offset + size;
+
+    VkDeviceSize absolute = ring->regionSize * ring->region + offset;
+    out->data = ring->mapped + absolute;
+    out->offset = (uint32_t)absolute;
+    return true;
+}
+
+static bool vulkan_frame_ring_flush(VulkanState* vulkan, FrameRing* ring) {
+    if (ring->coherent || !ring->head) {
+        return true;
+    }
+    VkMappedMemoryRange range = {
+        .sType = VK_STRUCTURE_TYPE_MAPPED_MEMORY_RANGE,
+        .memory = ring->mem,
+        .offset = ring->regionSize * ring->region,
+        .size = (ring->head + ring->alignment - 1) & ~(ring->alignment - 1)};
+    VkResult result = vkFlushMappedMemoryRanges(vulkan->device, 1, &range);
+    CHECKVK(result, "Failed to flush frame ring region %u", ring->region);
+    return true;
+}
+
+// NOTE: called once the frame's command buffers are submitted
+static void vulkan_frame_ring_retire(VulkanState* vulkan, FrameRing* ring) {
+    ring->regionFrame[ring->region] = vulkan->frameSync.submitted;
+}
+
+static bool vulkan_descriptor_pool_grow(VulkanState* vulkan, DescriptorAllocator* allocator) {
+    if (allocator->poolCount == MAX_DESCRIPTOR_POOLS) {
+        CERROR("Out of descriptor pools (%u)", MAX_DESCRIPTOR_POOLS);
+        return false;
+    }
+
+    VkDescriptorPoolSize poolSizes[] = {
+        {.type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC, .descriptorCount = DESCRIPTOR_SETS_PER_POOL},
+        {.type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC, .descriptorCount = DESCRIPTOR_SETS_PER_POOL}};
+    VkDescriptorPoolCreateInfo poolCI = {
+        .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO,
+        .maxSets = DESCRIPTOR_SETS_PER_POOL,
+        .poolSizeCount = array_size(poolSizes),
+        .pPoolSizes = poolSizes};
+    VkResult result = vkCreateDescriptorPool(vulkan->device, &poolCI, vulkan->allocator, &allocator->pools[allocator->poolCount]);
+    CHECKVK(result, "Failed to create descriptor pool %u", allocator->poolCount);
+    ++allocator->poolCount;
+    return true;
+}
+
+// NOTE: allocates from the newest pool and opens a new one once it runs dry
+static bool vulkan_descriptor_allocate(VulkanState* vulkan, DescriptorAllocator* allocator, VkDescriptorSetLayout layout, VkDescriptorSet* set) {
+    VkDescriptorSetAllocateInfo setAI = {
+        .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO,
+        .descriptorSetCount = 1,
+        .pSetLayouts = &layout};
+
+    if (allocator->poolCount) {
+        setAI.descriptorPool = allocator->pools[allocator->poolCount - 1];
+        VkResult result = vkAllocateDescriptorSets(vulkan->device, &setAI, set);
+        if (result == VK_SUCCESS) {
+            return true;
+        }
+        if (result != VK_ERROR_OUT_OF_POOL_MEMORY && result != VK_ERROR_FRAGMENTED_POOL) {
+            CERROR("Failed to allocate descriptor set [%d]", result);
+            return false;
+        }
+    }
+
+    if (!vulkan_descriptor_pool_grow(vulkan, allocator)) {
+        return false;
+    }
+    setAI.descriptorPool = allocator->pools[allocator->poolCount - 1];
+    VkResult result = vkAllocateDescriptorSets(vulkan->device, &setAI, set);
+    CHECKVK(result, "Failed to allocate descriptor set from a fresh pool");
+    return true;
+}
+
+// NOTE: both bindings point at the ring, the per-frame location comes from the dynamic offsets
+static void vulkan_frame_set_write(VulkanState* vulkan) {
+    FrameData* frame = &vulkan->frame;
+    VkDescriptorBufferInfo cameraInfo = {
+        .buffer = frame->ring.buf,
+        .offset = 0,
+        .range = sizeof(CameraData)};
+    VkDescriptorBufferInfo objectInfo = {
+        .buffer = frame->ring.buf,
+        .offset = 0,
+        .range = sizeof(ObjectData) * MAX_OBJECTS};
+    VkWriteDescriptorSet writes[] = {
+        {.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+         .dstSet = frame->set,
+         .dstBinding = 0,
+         .descriptorCount = 1,
+         .descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC,
+         .pBufferInfo = &cameraInfo},
+        {.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+         .dstSet = frame->set,
+         .dstBinding = 1,
+         .descriptorCount = 1,
+         .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC,
+         .pBufferInfo = &objectInfo}};
+    vkUpdateDescriptorSets(vulkan->device, array_size(writes), writes, 0, 0);
+}
+
+static bool vulkan_frame_data_init(VulkanState* vulkan) {
+    FrameData* frame = &vulkan->frame;
+    if (!vulkan_frame_ring_init(vulkan, FRAME_RING_REGION_SIZE, &frame->ring)) {
+        CERROR("Failed to create frame ring");
+        return false;
+    }
+
+    if (!vulkan_descriptor_allocate(vulkan, &vulkan->descriptors, vulkan->frameSetLayout, &frame->set)) {
+        CERROR("Failed to allocate frame descriptor set");
+        return false;
+    }
+
+    vulkan_frame_set_write(vulkan);
+    return true;
+}
+
+static bool vulkan_initialize_resources(VulkanState* vulkan) {
+    vulkan->shaderProgram[0] = (VkPipelineShaderStageCreateInfo){
+        .sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
+        .pName = "main",
+        .stage = VK_SHADER_STAGE_VERTEX_BIT,
+    };
+
+    VkShaderModuleCreateInfo moduleCI = {
+        .sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO,
+        .pCode = vertSpv,
+        .codeSize = sizeof(vertSpv)};
+    VkResult result = vkCreateShaderModule(vulkan->device, &moduleCI, vulkan->allocator, &vulkan->shaderProgram[0].module);
+    CHECKVK(result, "Failed to create Vertex shader");
+
+    vulkan->shaderProgram[1] = (VkPipelineShaderStageCreateInfo){
+        .sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
+        .pName = "main",
+        .stage = VK_SHADER_STAGE_FRAGMENT_BIT,
+    };
+
+    moduleCI.pCode = fragSpv;
+    moduleCI.codeSize = sizeof(fragSpv);
+    result = vkCreateShaderModule(vulkan->device, &moduleCI, vulkan->allocator, &vulkan->shaderProgram[1].module);
+    CHECKVK(result, "Failed to create Fragment shader");
+
+    for (uint32_t i = 0; i < NUM_VIEWES; ++i) {
+        if (!vulkan_commandbuffer_init(vulkan, vulkan->queueFamilyIndex, &vulkan->cmdBuffer[i])) {
+            CERROR("Failed to initialize commandbuffer %u", i);
+            return false;
+        }
+    }
+
+    if (!vulkan_frame_sync_init(vulkan)) {
+        CERROR("Failed to initialize frame sync");
+        return false;
+    }
+
+    if (!vulkan_gpu_timer_init(vulkan)) {
+        CERROR("Failed to initialize GPU timer");
+        return false;
+    }
+
+    {
+        VkDescriptorSetLayoutBinding bindings[] = {
+            {.binding = 0,
+             .descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC,
+             .descriptorCount = 1,
+             .stageFlags = VK_SHADER_STAGE_VERTEX_BIT},
+            {.binding = 1,
+             .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC,
+             .descriptorCount = 1,
+             .stageFlags = VK_SHADER_STAGE_VERTEX_BIT}};
+        VkDescriptorSetLayoutCreateInfo setLayoutCI = {
+            .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO,
+            .bindingCount = array_size(bindings),
+            .pBindings = bindings};
+        VkResult result = vkCreateDescriptorSetLayout(vulkan->device, &setLayoutCI, vulkan->allocator, &vulkan->frameSetLayout);
+        CHECKVK(result, "Failed to create frame descriptor set layout");
+
+        VkPipelineLayoutCreateInfo pipelineLayoutCI = {
+            .sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO,
+            .setLayoutCount = 1,
+            .pSetLayouts = &vulkan->frameSetLayout};
+
+        result = vkCreatePipelineLayout(vulkan->device, &pipelineLayoutCI, vulkan->allocator, &vulkan->pipelineLayout);
+        CHECKVK(result, "Failed to create pipeline layout");
+    }
+
+    if (!vulkan_frame_data_init(vulkan)) {
+        CERROR("Failed to initialize frame data");
+        return false;
+    }
+
+    vulkan->drawBuffer.attrDesc[0] = (VkVertexInputAttributeDescription){
+        .location = 0,
+        .binding = 0,
+        .format = VK_FORMAT_R32G32B32_SFLOAT,
+        .offset = offsetof(Vertex, pos)};
+
+    vulkan->drawBuffer.attrDesc[1] = (VkVertexInputAttributeDescription){
+        .location = 1,
+        .binding = 0,
+        .format = VK_FORMAT_R32G32B32_SFLOAT,
+        .offset = offsetof(Vertex, color)};
+
+    uint32_t indexCount = array_size(cubeIndices);
+    uint32_t vertexCount = array_size(cubeVertices);
+
+    if (!vulkan_vertex_buffer_create(vulkan, indexCount, vertexCount, &vulkan->drawBuffer)) {
+        CERROR("Failed to create buffers");
+        return false;
+    }
+
+    if (!vulkan_upload_init(vulkan)) {
+        CERROR("Failed to start the upload service");
+        return false;
+    }
+
+    // NOTE: the cubes are drawn once both uploads have landed
+    ImageState geometryRead = {
+        .stage = VK_PIPELINE_STAGE_VERTEX_INPUT_BIT,
+        .access = VK_ACCESS_INDEX_READ_BIT | VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT};
+    vulkan->drawBuffer.idxUpload = vulkan_upload_request(vulkan, vulkan->drawBuffer.idxBuf, cubeIndices, sizeof(uint16_t) * indexCount, geometryRead);
+    vulkan->drawBuffer.vtxUpload = vulkan_upload_request(vulkan, vulkan->drawBuffer.vtxBuf, cubeVertices, sizeof(Vertex) * vertexCount, geometryRead);
+    if (!vulkan->drawBuffer.idxUpload || !vulkan->drawBuffer.vtxUpload) {
+        CERROR("Failed to queue the geometry uploads");
+        return false;
+    }
+
+    return true;
+}
+
+static bool vulkan_find_layer(const char* layer) {
+    uint32_t layerCount;
+    VkResult result = vkEnumerateInstanceLayerProperties(&layerCount, 0);
     CHECKVK(result, "Failed to count Vulkan Layer Properties");
 
     if (layerCount > 0) {
@@ -838,7 +2090,95 @@ static bool vulkan_find_layer(const char* layer) {
     return false;
 }
 
+static bool vulkan_find_extension(VkExtensionProperties* extensions, uint32_t extensionCount, const char* extension) {
+    for (uint32_t i = 0; i < extensionCount; ++i) {
+        if (0 == strcmp(extension, extensions[i].extensionName)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// NOTE: best match first, a family with nothing but the wanted bits (a dedicated DMA or async compute engine),
+//       then one that at least isn't the graphics family, graphics families always accept transfer work
+static uint32_t vulkan_find_queue_family(VkQueueFamilyProperties* families, uint32_t familyCount, VkQueueFlags wanted, uint32_t graphicsFamily) {
+    VkQueueFlags workMask = VK_QUEUE_GRAPHICS_BIT | VK_QUEUE_COMPUTE_BIT | VK_QUEUE_TRANSFER_BIT;
+    for (uint32_t i = 0; i < familyCount; ++i) {
+        if ((families[i].queueFlags & workMask) == wanted) {
+            return i;
+        }
+    }
+    for (uint32_t i = 0; i < familyCount; ++i) {
+        if (i != graphicsFamily && (families[i].queueFlags & wanted) && !(families[i].queueFlags & VK_QUEUE_GRAPHICS_BIT)) {
+            return i;
+        }
+    }
+    return graphicsFamily;
+}
+
+// NOTE: takes the next queue of the family, or shares the last one taken once the family runs out
+static uint32_t vulkan_claim_queue(VkQueueFamilyProperties* families, uint32_t* claimed, float* priorities, uint32_t family, float priority) {
+    if (claimed[family] < families[family].queueCount) {
+        priorities[claimed[family]] = priority;
+        return claimed[family]++;
+    }
+    return claimed[family] - 1;
+}
+
+static void vulkan_chain_append(void* chain, void* item) {
+    VkBaseOutStructure* next = (VkBaseOutStructure*)chain;
+    while (next->pNext) {
+        next = next->pNext;
+    }
+    next->pNext = (VkBaseOutStructure*)item;
+}
+
+// NOTE: distance between neighbouring depth values at view distance z, |d depth / dz| is the same for both directions
+static float vulkan_depth_step(const DepthConfig* depth, float z) {
+    float n = depth->nearZ;
+    float f = depth->farZ;
+    float slope = isinf(f) ? n / (z * z) : f * n / (z * z * (f - n));
+    float ulp;
+    if (depth->format == VK_FORMAT_D32_SFLOAT) {
+        float value;
+        if (depth->reverseZ) {
+            value = isinf(f) ? n / z : n * (f - z) / (z * (f - n));
+        } else {
+            value = isinf(f) ? (z - n) / z : f * (z - n) / (z * (f - n));
+        }
+        ulp = fmaxf(value, FLT_MIN) * FLT_EPSILON;
+    } else {
+        uint32_t bits = depth->format == VK_FORMAT_D16_UNORM ? 16 : 24;
+        ulp = 1.0f / (float)((1u << bits) - 1);
+    }
+    return ulp / slope;
+}
+
+static bool vulkan_select_depth_format(VulkanState* vulkan) {
+    for (uint32_t k = 0; k < array_size(DEPTH_CONFIGS); ++k) {
+        uint32_t i = DEPTH_PREFER_D16 ? (k + array_size(DEPTH_CONFIGS) - 1) % array_size(DEPTH_CONFIGS) : k;
+        VkFormatProperties props = {};
+        vkGetPhysicalDeviceFormatProperties(vulkan->physical, DEPTH_CONFIGS[i].format, &props);
+        if (props.optimalTilingFeatures & VK_FORMAT_FEATURE_DEPTH_STENCIL_ATTACHMENT_BIT) {
+            vulkan->depth = DEPTH_CONFIGS[i];
+            if (k > 0) {
+                CWARN("Preferred depth format unsupported, fell back to preference %u", k);
+            }
+            float worst = isinf(vulkan->depth.farZ) ? DEPTH_STEP_DISTANCE : vulkan->depth.farZ;
+            CINFO("Depth format %d selected (preference %u), near %.3f far %.1f%s, step %.3f mm at %.0f m",
+                  vulkan->depth.format, k, vulkan->depth.nearZ, vulkan->depth.farZ, vulkan->depth.reverseZ ? " reverse-Z" : "",
+                  vulkan_depth_step(&vulkan->depth, worst) * 1000.0f, worst);
+            return true;
+        }
+        CDEBUG("Depth format %d not supported as attachment", DEPTH_CONFIGS[i].format);
+    }
+    CERROR("No supported depth format in the preference list");
+    return false;
+}
+
 static bool vulkan_initialize_device(OpenXrProgram* program, VulkanState* vulkan) {
+    vulkan_host_allocator_init(vulkan);
+
     XrGraphicsRequirementsVulkan2KHR graphicsRequirements = {
         .type = XR_TYPE_GRAPHICS_REQUIREMENTS_VULKAN2_KHR};
 
@@ -859,7 +2199,7 @@ static bool vulkan_initialize_device(OpenXrProgram* program, VulkanState* vulkan
         .pApplicationName = "MyOculusTest",
         .applicationVersion = 1,
         .pEngineName = "MyOculusTest",
-        .apiVersion = VK_API_VERSION_1_0};
+        .apiVersion = VK_API_VERSION_1_1};
 
     VkInstanceCreateInfo instanceCI = {
         .sType = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO,
@@ -913,7 +2253,7 @@ static bool vulkan_initialize_device(OpenXrProgram* program, VulkanState* vulkan
         .systemId = program->systemID,
         .pfnGetInstanceProcAddr = &vkGetInstanceProcAddr,
         .vulkanCreateInfo = &instanceCI,
-        0};
+        .vulkanAllocator = vulkan->allocator};
 
     {
         PFN_xrCreateVulkanInstanceKHR func = 0;
@@ -931,7 +2271,7 @@ static bool vulkan_initialize_device(OpenXrProgram* program, VulkanState* vulkan
 #if defined(NDEBUG)
     {
         PFN_vkCreateDebugUtilsMessengerEXT func = (PFN_vkCreateDebugUtilsMessengerEXT)vkGetInstanceProcAddr(vulkan->instance, "vkCreateDebugUtilsMessengerEXT");
-        if (!func || func(vulkan->instance, &debugUtilsCI, 0, &vulkan->debugMessenger)) {
+        if (!func || func(vulkan->instance, &debugUtilsCI, vulkan->allocator, &vulkan->debugMessenger)) {
             CERROR("Failed to create debug messenger");
             return false;
         }
@@ -955,11 +2295,11 @@ static bool vulkan_initialize_device(OpenXrProgram* program, VulkanState* vulkan
         CHECKXR(result, "Failed to get physical device");
     }
 
-    float queuePriorities = 0;
-    VkDeviceQueueCreateInfo queueCI = {
-        .sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO,
-        .queueCount = 1,
-        .pQueuePriorities = &queuePriorities};
+    // NOTE: the graphics queue feeds the compositor deadline so it gets the highest priority,
+    //       uploads only have to land eventually and get the lowest
+    float queuePriorities[3][3];
+    VkDeviceQueueCreateInfo queueCIs[3];
+    uint32_t queueCICount = 0;
     {
         uint32_t queueFamilyCount = 0;
         vkGetPhysicalDeviceQueueFamilyProperties(vulkan->physical, &queueFamilyCount, 0);
@@ -973,7 +2313,7 @@ static bool vulkan_initialize_device(OpenXrProgram* program, VulkanState* vulkan
         bool found = false;
         for (uint32_t i = 0; i < queueFamilyCount; ++i) {
             if ((queueFamilies[i].queueFlags & VK_QUEUE_GRAPHICS_BIT) != 0u) {
-                vulkan->queueFamilyIndex = queueCI.queueFamilyIndex = i;
+                vulkan->queueFamilyIndex = i;
                 found = true;
                 break;
             }
@@ -983,22 +2323,298 @@ static bool vulkan_initialize_device(OpenXrProgram* program, VulkanState* vulkan
             CERROR("Failed to find Graphics Queue family");
             return false;
         }
+
+        uint32_t graphicsFamily = vulkan->queueFamilyIndex;
+        uint32_t timestampBits = queueFamilies[graphicsFamily].timestampValidBits;
+        vulkan->caps.timestamps = timestampBits != 0;
+        vulkan->gpuTimer.mask = timestampBits >= 64 ? ~0ull : (1ull << timestampBits) - 1;
+        vulkan->compute.family = vulkan_find_queue_family(queueFamilies, queueFamilyCount, VK_QUEUE_COMPUTE_BIT, graphicsFamily);
+        vulkan->transfer.family = vulkan_find_queue_family(queueFamilies, queueFamilyCount, VK_QUEUE_TRANSFER_BIT, graphicsFamily);
+
+        uint32_t families[3] = {graphicsFamily, vulkan->compute.family, vulkan->transfer.family};
+        uint32_t claimed[128] = {0};
+        uint32_t slots[3];
+        for (uint32_t i = 0; i < array_size(families); ++i) {
+            slots[i] = queueCICount;
+            for (uint32_t j = 0; j < queueCICount; ++j) {
+                if (queueCIs[j].queueFamilyIndex == families[i]) {
+                    slots[i] = j;
+                }
+            }
+            if (slots[i] == queueCICount) {
+                queueCIs[queueCICount++] = (VkDeviceQueueCreateInfo){
+                    .sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO,
+                    .queueFamilyIndex = families[i],
+                    .pQueuePriorities = queuePriorities[slots[i]]};
+            }
+        }
+        uint32_t graphicsIndex = vulkan_claim_queue(queueFamilies, claimed, queuePriorities[slots[0]], graphicsFamily, 1.0f);
+        vulkan->compute.index = vulkan_claim_queue(queueFamilies, claimed, queuePriorities[slots[1]], vulkan->compute.family, 0.5f);
+        vulkan->transfer.index = vulkan_claim_queue(queueFamilies, claimed, queuePriorities[slots[2]], vulkan->transfer.family, 0.0f);
+        for (uint32_t i = 0; i < queueCICount; ++i) {
+            queueCIs[i].queueCount = claimed[queueCIs[i].queueFamilyIndex];
+        }
+        vulkan->compute.shared = vulkan->compute.family == graphicsFamily && vulkan->compute.index == graphicsIndex;
+        vulkan->transfer.shared = vulkan->transfer.family == graphicsFamily && vulkan->transfer.index == graphicsIndex;
+
+        CINFO("Queues: graphics %u:%u, compute %u:%u%s, transfer %u:%u%s", graphicsFamily, graphicsIndex,
+              vulkan->compute.family, vulkan->compute.index, vulkan->compute.shared ? " (shared)" : "",
+              vulkan->transfer.family, vulkan->transfer.index, vulkan->transfer.shared ? " (shared)" : "");
     }
 
+    uint32_t deviceExtensionCount = 0;
+    const char* deviceExtensions[32];
+
+    VkPhysicalDeviceTimelineSemaphoreFeaturesKHR timelineFeatures = {
+        .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_TIMELINE_SEMAPHORE_FEATURES_KHR};
+#if defined(VK_KHR_dynamic_rendering)
+    VkPhysicalDeviceDynamicRenderingFeaturesKHR dynamicRenderingFeatures = {
+        .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DYNAMIC_RENDERING_FEATURES_KHR};
+#endif
+#if defined(VK_KHR_synchronization2)
+    VkPhysicalDeviceSynchronization2FeaturesKHR synchronization2Features = {
+        .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_SYNCHRONIZATION_2_FEATURES_KHR};
+#endif
+#if defined(VK_EXT_graphics_pipeline_library)
+    VkPhysicalDeviceGraphicsPipelineLibraryFeaturesEXT pipelineLibraryFeatures = {
+        .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_GRAPHICS_PIPELINE_LIBRARY_FEATURES_EXT};
+    VkPhysicalDeviceGraphicsPipelineLibraryPropertiesEXT pipelineLibraryProps = {
+        .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_GRAPHICS_PIPELINE_LIBRARY_PROPERTIES_EXT};
+    bool hasPipelineLibrary = false;
+#endif
+#if defined(VK_EXT_fragment_density_map)
+    VkPhysicalDeviceFragmentDensityMapFeaturesEXT densityMapFeatures = {
+        .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FRAGMENT_DENSITY_MAP_FEATURES_EXT};
+    VkPhysicalDeviceFragmentDensityMapPropertiesEXT densityMapProps = {
+        .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FRAGMENT_DENSITY_MAP_PROPERTIES_EXT};
+#endif
+#if defined(VK_KHR_fragment_shading_rate)
+    VkPhysicalDeviceFragmentShadingRateFeaturesKHR shadingRateFeatures = {
+        .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FRAGMENT_SHADING_RATE_FEATURES_KHR};
+    VkPhysicalDeviceFragmentShadingRatePropertiesKHR shadingRateProps = {
+        .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FRAGMENT_SHADING_RATE_PROPERTIES_KHR};
+    bool hasShadingRate = false;
+#endif
+    VkPhysicalDeviceFeatures2 features2 = {
+        .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2};
+    {  // NOTE: optional device extensions
+        uint32_t availableCount = 0;
+        VkResult result = vkEnumerateDeviceExtensionProperties(vulkan->physical, 0, &availableCount, 0);
+        CHECKVK(result, "Failed to count device extensions");
+
+        VkExtensionProperties* available = malloc(sizeof(VkExtensionProperties) * availableCount);
+        if (!available) {
+            CERROR("Failed to allocate memory for device extension enumeration");
+            return false;
+        }
+        result = vkEnumerateDeviceExtensionProperties(vulkan->physical, 0, &availableCount, available);
+        if (result != VK_SUCCESS) {
+            CERROR("Failed to get device extensions");
+            free(available);
+            return false;
+        }
+
+        if (vulkan_find_extension(available, availableCount, VK_KHR_TIMELINE_SEMAPHORE_EXTENSION_NAME)) {
+            vulkan_chain_append(&features2, &timelineFeatures);
+        }
+#if defined(VK_KHR_dynamic_rendering)
+        bool hasDynamicRendering =
+            vulkan_find_extension(available, availableCount, VK_KHR_DYNAMIC_RENDERING_EXTENSION_NAME) &&
+            vulkan_find_extension(available, availableCount, VK_KHR_DEPTH_STENCIL_RESOLVE_EXTENSION_NAME) &&
+            vulkan_find_extension(available, availableCount, VK_KHR_CREATE_RENDERPASS_2_EXTENSION_NAME);
+        if (hasDynamicRendering) {
+            vulkan_chain_append(&features2, &dynamicRenderingFeatures);
+        }
+#endif
+#if defined(VK_KHR_synchronization2)
+        if (vulkan_find_extension(available, availableCount, VK_KHR_SYNCHRONIZATION_2_EXTENSION_NAME)) {
+            vulkan_chain_append(&features2, &synchronization2Features);
+        }
+#endif
+#if defined(VK_EXT_memory_budget)
+        if (vulkan_find_extension(available, availableCount, VK_EXT_MEMORY_BUDGET_EXTENSION_NAME)) {
+            vulkan->caps.memoryBudget = true;
+            deviceExtensions[deviceExtensionCount++] = VK_EXT_MEMORY_BUDGET_EXTENSION_NAME;
+        }
+#endif
+#if defined(VK_EXT_graphics_pipeline_library)
+        hasPipelineLibrary =
+            vulkan_find_extension(available, availableCount, VK_KHR_PIPELINE_LIBRARY_EXTENSION_NAME) &&
+            vulkan_find_extension(available, availableCount, VK_EXT_GRAPHICS_PIPELINE_LIBRARY_EXTENSION_NAME);
+        if (hasPipelineLibrary) {
+            vulkan_chain_append(&features2, &pipelineLibraryFeatures);
+
+            VkPhysicalDeviceProperties2 props2 = {
+                .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2,
+                .pNext = &pipelineLibraryProps};
+            vkGetPhysicalDeviceProperties2(vulkan->physical, &props2);
+        }
+#endif
+#if defined(VK_EXT_fragment_density_map)
+        if (vulkan_find_extension(available, availableCount, VK_EXT_FRAGMENT_DENSITY_MAP_EXTENSION_NAME)) {
+            vulkan_chain_append(&features2, &densityMapFeatures);
+
+            VkPhysicalDeviceProperties2 props2 = {
+                .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2,
+                .pNext = &densityMapProps};
+            vkGetPhysicalDeviceProperties2(vulkan->physical, &props2);
+        }
+#endif
+#if defined(VK_KHR_fragment_shading_rate)
+        hasShadingRate =
+            vulkan_find_extension(available, availableCount, VK_KHR_CREATE_RENDERPASS_2_EXTENSION_NAME) &&
+            vulkan_find_extension(available, availableCount, VK_KHR_FRAGMENT_SHADING_RATE_EXTENSION_NAME);
+        if (hasShadingRate) {
+            vulkan_chain_append(&features2, &shadingRateFeatures);
+
+            VkPhysicalDeviceProperties2 props2 = {
+                .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2,
+                .pNext = &shadingRateProps};
+            vkGetPhysicalDeviceProperties2(vulkan->physical, &props2);
+        }
+#endif
+        free(available);
+
+        vkGetPhysicalDeviceFeatures2(vulkan->physical, &features2);
+
+        if (timelineFeatures.timelineSemaphore) {
+            vulkan->caps.timelineSemaphore = true;
+            deviceExtensions[deviceExtensionCount++] = VK_KHR_TIMELINE_SEMAPHORE_EXTENSION_NAME;
+        }
+#if defined(VK_KHR_dynamic_rendering)
+        if (dynamicRenderingFeatures.dynamicRendering) {
+            vulkan->caps.dynamicRendering = true;
+            deviceExtensions[deviceExtensionCount++] = VK_KHR_CREATE_RENDERPASS_2_EXTENSION_NAME;
+            deviceExtensions[deviceExtensionCount++] = VK_KHR_DEPTH_STENCIL_RESOLVE_EXTENSION_NAME;
+            deviceExtensions[deviceExtensionCount++] = VK_KHR_DYNAMIC_RENDERING_EXTENSION_NAME;
+        }
+#endif
+#if defined(VK_KHR_synchronization2)
+        if (synchronization2Features.synchronization2) {
+            vulkan->caps.synchronization2 = true;
+            deviceExtensions[deviceExtensionCount++] = VK_KHR_SYNCHRONIZATION_2_EXTENSION_NAME;
+        }
+#endif
+#if defined(VK_EXT_graphics_pipeline_library)
+        // NOTE: without fast linking a library link costs about as much as a full compile
+        if (hasPipelineLibrary && pipelineLibraryFeatures.graphicsPipelineLibrary && pipelineLibraryProps.graphicsPipelineLibraryFastLinking) {
+            vulkan->caps.graphicsPipelineLibrary = true;
+            deviceExtensions[deviceExtensionCount++] = VK_KHR_PIPELINE_LIBRARY_EXTENSION_NAME;
+            deviceExtensions[deviceExtensionCount++] = VK_EXT_GRAPHICS_PIPELINE_LIBRARY_EXTENSION_NAME;
+        }
+#endif
+        // NOTE: density maps and shading rates can't be enabled on the same device, so the foveation mode is picked
+        //       before it is created. The runtime's maps are tuned to the lenses, the generated ones are the fallback
+        bool densityMap = false;
+        bool shadingRate = false;
+#if defined(VK_EXT_fragment_density_map)
+        densityMap = densityMapFeatures.fragmentDensityMap;
+#endif
+#if defined(VK_KHR_fragment_shading_rate)
+        shadingRate = hasShadingRate && shadingRateFeatures.attachmentFragmentShadingRate;
+#endif
+        if (densityMap && program->caps.foveation) {
+            vulkan->foveation = FOVEATION_Runtime;
+        } else if (densityMap && GENERATED_FOVEATION) {
+            vulkan->foveation = FOVEATION_DensityMap;
+        } else if (shadingRate && GENERATED_FOVEATION) {
+            vulkan->foveation = FOVEATION_ShadingRate;
+        }
+
+#if defined(VK_EXT_fragment_density_map)
+        if (vulkan->foveation == FOVEATION_Runtime || vulkan->foveation == FOVEATION_DensityMap) {
+            vulkan->caps.fragmentDensityMap = true;
+            vulkan->densityTexel = densityMapProps.minFragmentDensityTexelSize;
+            deviceExtensions[deviceExtensionCount++] = VK_EXT_FRAGMENT_DENSITY_MAP_EXTENSION_NAME;
+        }
+#endif
+#if defined(VK_KHR_fragment_shading_rate)
+        if (vulkan->foveation == FOVEATION_ShadingRate) {
+            vulkan->caps.fragmentShadingRate = true;
+            vulkan->shadingRateTexel = shadingRateProps.maxFragmentShadingRateAttachmentTexelSize;
+            if (!vulkan->caps.dynamicRendering) {
+                deviceExtensions[deviceExtensionCount++] = VK_KHR_CREATE_RENDERPASS_2_EXTENSION_NAME;
+            }
+            deviceExtensions[deviceExtensionCount++] = VK_KHR_FRAGMENT_SHADING_RATE_EXTENSION_NAME;
+        }
+#endif
+    }
+
+    CINFO("Device capabilities:");
+    CINFO("  [%s] Timeline semaphore", vulkan->caps.timelineSemaphore ? "V" : " ");
+    CINFO("  [%s] Dynamic rendering", vulkan->caps.dynamicRendering ? "V" : " ");
+    CINFO("  [%s] Synchronization2", vulkan->caps.synchronization2 ? "V" : " ");
+    CINFO("  [%s] Graphics pipeline library", vulkan->caps.graphicsPipelineLibrary ? "V" : " ");
+    CINFO("  [%s] Memory budget", vulkan->caps.memoryBudget ? "V" : " ");
+    CINFO("  [%s] Timestamps", vulkan->caps.timestamps ? "V" : " ");
+    CINFO("  [%s] Fragment density map", vulkan->caps.fragmentDensityMap ? "V" : " ");
+    CINFO("  [%s] Fragment shading rate", vulkan->caps.fragmentShadingRate ? "V" : " ");
+
     VkPhysicalDeviceFeatures features = {};
     VkDeviceCreateInfo deviceCI = {
         .sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO,
-        .queueCreateInfoCount = 1,
-        .pQueueCreateInfos = &queueCI,
+        .queueCreateInfoCount = queueCICount,
+        .pQueueCreateInfos = queueCIs,
+        .enabledExtensionCount = deviceExtensionCount,
+        .ppEnabledExtensionNames = deviceExtensions,
         .pEnabledFeatures = &features};
 
+    if (vulkan->caps.timelineSemaphore) {
+        timelineFeatures = (VkPhysicalDeviceTimelineSemaphoreFeaturesKHR){
+            .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_TIMELINE_SEMAPHORE_FEATURES_KHR,
+            .timelineSemaphore = VK_TRUE};
+        vulkan_chain_append(&deviceCI, &timelineFeatures);
+    }
+#if defined(VK_KHR_dynamic_rendering)
+    if (vulkan->caps.dynamicRendering) {
+        dynamicRenderingFeatures = (VkPhysicalDeviceDynamicRenderingFeaturesKHR){
+            .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DYNAMIC_RENDERING_FEATURES_KHR,
+            .dynamicRendering = VK_TRUE};
+        vulkan_chain_append(&deviceCI, &dynamicRenderingFeatures);
+    }
+#endif
+#if defined(VK_KHR_synchronization2)
+    if (vulkan->caps.synchronization2) {
+        synchronization2Features = (VkPhysicalDeviceSynchronization2FeaturesKHR){
+            .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_SYNCHRONIZATION_2_FEATURES_KHR,
+            .synchronization2 = VK_TRUE};
+        vulkan_chain_append(&deviceCI, &synchronization2Features);
+    }
+#endif
+#if defined(VK_EXT_graphics_pipeline_library)
+    if (vulkan->caps.graphicsPipelineLibrary) {
+        pipelineLibraryFeatures = (VkPhysicalDeviceGraphicsPipelineLibraryFeaturesEXT){
+            .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_GRAPHICS_PIPELINE_LIBRARY_FEATURES_EXT,
+            .graphicsPipelineLibrary = VK_TRUE};
+        vulkan_chain_append(&deviceCI, &pipelineLibraryFeatures);
+    }
+#endif
+#if defined(VK_EXT_fragment_density_map)
+    if (vulkan->caps.fragmentDensityMap) {
+        densityMapFeatures = (VkPhysicalDeviceFragmentDensityMapFeaturesEXT){
+            .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FRAGMENT_DENSITY_MAP_FEATURES_EXT,
+            .fragmentDensityMap = VK_TRUE};
+        vulkan_chain_append(&deviceCI, &densityMapFeatures);
+    }
+#endif
+#if defined(VK_KHR_fragment_shading_rate)
+    if (vulkan->caps.fragmentShadingRate) {
+        // NOTE: every implementation of the extension has the pipeline rate, the attachment rate builds on it
+        shadingRateFeatures = (VkPhysicalDeviceFragmentShadingRateFeaturesKHR){
+            .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FRAGMENT_SHADING_RATE_FEATURES_KHR,
+            .pipelineFragmentShadingRate = VK_TRUE,
+            .attachmentFragmentShadingRate = VK_TRUE};
+        vulkan_chain_append(&deviceCI, &shadingRateFeatures);
+    }
+#endif
+
     XrVulkanDeviceCreateInfoKHR xrDeviceCI = {
         .type = XR_TYPE_VULKAN_DEVICE_CREATE_INFO_KHR,
         .systemId = program->systemID,
         .pfnGetInstanceProcAddr = &vkGetInstanceProcAddr,
         .vulkanCreateInfo = &deviceCI,
         .vulkanPhysicalDevice = vulkan->physical,
-        .vulkanAllocator = 0};
+        .vulkanAllocator = vulkan->allocator};
 
     {
         PFN_xrCreateVulkanDeviceKHR func = 0;
@@ -1014,9 +2630,58 @@ static bool vulkan_initialize_device(OpenXrProgram* program, VulkanState* vulkan
         CHECKVK(vkresult, "Failed to create vulkan logical device [VK]");
     }
 
-    vkGetDeviceQueue(vulkan->device, queueCI.queueFamilyIndex, 0, &vulkan->queue);
+    vkGetDeviceQueue(vulkan->device, vulkan->queueFamilyIndex, 0, &vulkan->queue);
+    vkGetDeviceQueue(vulkan->device, vulkan->compute.family, vulkan->compute.index, &vulkan->compute.queue);
+    vkGetDeviceQueue(vulkan->device, vulkan->transfer.family, vulkan->transfer.index, &vulkan->transfer.queue);
+
+    if (vulkan->caps.timelineSemaphore) {
+        vulkan->waitSemaphores = (PFN_vkWaitSemaphoresKHR)vkGetDeviceProcAddr(vulkan->device, "vkWaitSemaphoresKHR");
+        vulkan->getSemaphoreCounterValue = (PFN_vkGetSemaphoreCounterValueKHR)vkGetDeviceProcAddr(vulkan->device, "vkGetSemaphoreCounterValueKHR");
+        if (!vulkan->waitSemaphores || !vulkan->getSemaphoreCounterValue) {
+            CWARN("Failed to load timeline semaphore functions");
+            vulkan->caps.timelineSemaphore = false;
+        }
+    }
+#if defined(VK_KHR_dynamic_rendering)
+    if (vulkan->caps.dynamicRendering) {
+        vulkan->cmdBeginRendering = (PFN_vkCmdBeginRenderingKHR)vkGetDeviceProcAddr(vulkan->device, "vkCmdBeginRenderingKHR");
+        vulkan->cmdEndRendering = (PFN_vkCmdEndRenderingKHR)vkGetDeviceProcAddr(vulkan->device, "vkCmdEndRenderingKHR");
+        if (!vulkan->cmdBeginRendering || !vulkan->cmdEndRendering) {
+            CWARN("Failed to load dynamic rendering functions, using render passes");
+            vulkan->caps.dynamicRendering = false;
+        }
+    }
+#endif
+#if defined(VK_KHR_synchronization2)
+    if (vulkan->caps.synchronization2) {
+        vulkan->cmdPipelineBarrier2 = (PFN_vkCmdPipelineBarrier2KHR)vkGetDeviceProcAddr(vulkan->device, "vkCmdPipelineBarrier2KHR");
+        if (!vulkan->cmdPipelineBarrier2) {
+            CWARN("Failed to load synchronization2 functions, using legacy barriers");
+            vulkan->caps.synchronization2 = false;
+        }
+    }
+#endif
+#if defined(VK_KHR_fragment_shading_rate)
+    if (vulkan->caps.fragmentShadingRate) {
+        vulkan->createRenderPass2 = (PFN_vkCreateRenderPass2KHR)vkGetDeviceProcAddr(vulkan->device, "vkCreateRenderPass2KHR");
+        if (!vulkan->createRenderPass2) {
+            CWARN("Failed to load renderpass2 functions, no shading rate attachments");
+            vulkan->caps.fragmentShadingRate = false;
+            vulkan->foveation = FOVEATION_Off;
+        }
+    }
+#endif
 
     vkGetPhysicalDeviceMemoryProperties(vulkan->physical, &vulkan->memProps);
+    {
+        VkPhysicalDeviceProperties props = {};
+        vkGetPhysicalDeviceProperties(vulkan->physical, &props);
+        vulkan->limits = props.limits;
+    }
+
+    if (!vulkan_select_depth_format(vulkan)) {
+        return false;
+    }
 
     if (!vulkan_initialize_resources(vulkan)) {
         return false;
@@ -1025,7 +2690,7 @@ static bool vulkan_initialize_device(OpenXrProgram* program, VulkanState* vulkan
     program->graphicsBinding.instance = vulkan->instance;
     program->graphicsBinding.physicalDevice = vulkan->physical;
     program->graphicsBinding.device = vulkan->device;
-    program->graphicsBinding.queueFamilyIndex = queueCI.queueFamilyIndex;
+    program->graphicsBinding.queueFamilyIndex = vulkan->queueFamilyIndex;
     program->graphicsBinding.queueIndex = 0;
     return true;
 }
@@ -1061,6 +2726,15 @@ static bool program_log_extensions(char* layer, char* indent) {
     return true;
 }
 
+static bool program_find_extension(XrExtensionProperties* extensions, uint32_t extensionCount, const char* extension) {
+    for (uint32_t i = 0; i < extensionCount; ++i) {
+        if (0 == strcmp(extension, extensions[i].extensionName)) {
+            return true;
+        }
+    }
+    return false;
+}
+
 static bool program_craete_instance(OpenXrProgram* program, XrInstanceCreateInfoAndroidKHR* androidInstanceCI) {
     // NOTE: log extensions
     if (!program_log_extensions(0, "")) {
@@ -1097,13 +2771,55 @@ static bool program_craete_instance(OpenXrProgram* program, XrInstanceCreateInfo
         }
     }
 
-    const char* extensions[] = {
+    const char* extensions[16] = {
         XR_KHR_ANDROID_CREATE_INSTANCE_EXTENSION_NAME,
         XR_KHR_VULKAN_ENABLE2_EXTENSION_NAME};
+    uint32_t extensionCount = 2;
+
+    // NOTE: optional extensions, only requested when the runtime has them
+    {
+        uint32_t availableCount = 0;
+        XrResult result = xrEnumerateInstanceExtensionProperties(0, 0, &availableCount, 0);
+        CHECKXR(result, "Failed to count Instance Extensions");
+
+        XrExtensionProperties* available = malloc(sizeof(XrExtensionProperties) * availableCount);
+        for (uint32_t i = 0; i < availableCount; ++i) {
+            available[i] = (XrExtensionProperties){.type = XR_TYPE_EXTENSION_PROPERTIES};
+        }
+        result = xrEnumerateInstanceExtensionProperties(0, availableCount, &availableCount, available);
+        if (!XR_SUCCEEDED(result)) {
+            CERROR("Failed to get Instance Extensions");
+            free(available);
+            return false;
+        }
+
+#if defined(XR_META_recommended_layer_resolution)
+        program->caps.recommendedLayerResolution = program_find_extension(available, availableCount, XR_META_RECOMMENDED_LAYER_RESOLUTION_EXTENSION_NAME);
+        if (program->caps.recommendedLayerResolution) {
+            extensions[extensionCount++] = XR_META_RECOMMENDED_LAYER_RESOLUTION_EXTENSION_NAME;
+        }
+#endif
+        program->caps.foveation =
+            program_find_extension(available, availableCount, XR_FB_SWAPCHAIN_UPDATE_STATE_EXTENSION_NAME) &&
+            program_find_extension(available, availableCount, XR_FB_FOVEATION_EXTENSION_NAME) &&
+            program_find_extension(available, availableCount, XR_FB_FOVEATION_CONFIGURATION_EXTENSION_NAME) &&
+            program_find_extension(available, availableCount, XR_FB_FOVEATION_VULKAN_EXTENSION_NAME);
+        if (program->caps.foveation) {
+            extensions[extensionCount++] = XR_FB_SWAPCHAIN_UPDATE_STATE_EXTENSION_NAME;
+            extensions[extensionCount++] = XR_FB_FOVEATION_EXTENSION_NAME;
+            extensions[extensionCount++] = XR_FB_FOVEATION_CONFIGURATION_EXTENSION_NAME;
+            extensions[extensionCount++] = XR_FB_FOVEATION_VULKAN_EXTENSION_NAME;
+        }
+        program->caps.visibilityMask = VISIBILITY_MASK && program_find_extension(available, availableCount, XR_KHR_VISIBILITY_MASK_EXTENSION_NAME);
+        if (program->caps.visibilityMask) {
+            extensions[extensionCount++] = XR_KHR_VISIBILITY_MASK_EXTENSION_NAME;
+        }
+        free(available);
+    }
 
     XrInstanceCreateInfo instanceCI = {
         .type = XR_TYPE_INSTANCE_CREATE_INFO,
-        .enabledExtensionCount = 2,
+        .enabledExtensionCount = extensionCount,
         .enabledExtensionNames = extensions,
         .next = (XrBaseInStructure*)androidInstanceCI};
 
@@ -1121,6 +2837,38 @@ static bool program_craete_instance(OpenXrProgram* program, XrInstanceCreateInfo
         CINFO("Instance: '%s' [%llu]", instanceProps.runtimeName, instanceProps.runtimeVersion);
     }
 
+#if defined(XR_META_recommended_layer_resolution)
+    if (program->caps.recommendedLayerResolution) {
+        XrResult result = xrGetInstanceProcAddr(
+            program->instance,
+            "xrGetRecommendedLayerResolutionMETA",
+            (PFN_xrVoidFunction*)&program->getRecommendedLayerResolution);
+        if (!XR_SUCCEEDED(result) || !program->getRecommendedLayerResolution) {
+            CWARN("Failed to load xrGetRecommendedLayerResolutionMETA");
+            program->caps.recommendedLayerResolution = false;
+        }
+    }
+#endif
+    if (program->caps.foveation) {
+        XrResult result = xrGetInstanceProcAddr(program->instance, "xrCreateFoveationProfileFB", (PFN_xrVoidFunction*)&program->foveation.createProfile);
+        result = XR_SUCCEEDED(result) ? xrGetInstanceProcAddr(program->instance, "xrDestroyFoveationProfileFB", (PFN_xrVoidFunction*)&program->foveation.destroyProfile) : result;
+        result = XR_SUCCEEDED(result) ? xrGetInstanceProcAddr(program->instance, "xrUpdateSwapchainFB", (PFN_xrVoidFunction*)&program->foveation.updateSwapchain) : result;
+        if (!XR_SUCCEEDED(result)) {
+            CWARN("Failed to load the foveation functions");
+            program->caps.foveation = false;
+        }
+    }
+    if (program->caps.visibilityMask) {
+        XrResult result = xrGetInstanceProcAddr(program->instance, "xrGetVisibilityMaskKHR", (PFN_xrVoidFunction*)&program->getVisibilityMask);
+        if (!XR_SUCCEEDED(result) || !program->getVisibilityMask) {
+            CWARN("Failed to load xrGetVisibilityMaskKHR");
+            program->caps.visibilityMask = false;
+        }
+    }
+    CINFO("Runtime capabilities:");
+    CINFO("  [%s] Recommended layer resolution", program->caps.recommendedLayerResolution ? "V" : " ");
+    CINFO("  [%s] Foveation", program->caps.foveation ? "V" : " ");
+
     return true;
 }
 
@@ -1446,50 +3194,133 @@ static int16_t vulkan_select_swapchain_format(int64_t* formats, uint32_t formatC
     return VK_FORMAT_UNDEFINED;
 }
 
-static bool vulkan_depth_buffer_create(VulkanState* vulkan, VkFormat depthFormat, XrSwapchainCreateInfo* swapchainCI, DepthBuffer* depthBuffer) {
+// NOTE: transient attachments try LAZILY_ALLOCATED memory first, tilers may never commit it
+static bool vulkan_attachment_image_create(
+    VulkanState* vulkan,
+    VkFormat format,
+    VkExtent2D size,
+    VkSampleCountFlagBits samples,
+    VkImageUsageFlags usage,
+    bool transient,
+    MemoryCategory category,
+    VkImage* image,
+    VkDeviceMemory* memory,
+    VkDeviceSize* allocated,
+    bool* lazy) {
     VkImageCreateInfo imageCI = {
         .sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO,
         .imageType = VK_IMAGE_TYPE_2D,
-        .extent = {.width = swapchainCI->width, .height = swapchainCI->height, .depth = 1},
+        .extent = {.width = size.width, .height = size.height, .depth = 1},
         .mipLevels = 1,
         .arrayLayers = 1,
-        .format = depthFormat,
+        .format = format,
         .tiling = VK_IMAGE_TILING_OPTIMAL,
         .initialLayout = VK_IMAGE_LAYOUT_UNDEFINED,
-        .usage = VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT,
-        .samples = swapchainCI->sampleCount,
+        .usage = usage | (transient ? VK_IMAGE_USAGE_TRANSIENT_ATTACHMENT_BIT : 0),
+        .samples = samples,
         .sharingMode = VK_SHARING_MODE_EXCLUSIVE};
 
-    VkResult result = vkCreateImage(vulkan->device, &imageCI, 0, &depthBuffer->depthImage);
+    VkResult result = vkCreateImage(vulkan->device, &imageCI, vulkan->allocator, image);
+    CHECKVK(result, "Failed to create attachment image");
 
     VkMemoryRequirements memReq = {};
-    vkGetImageMemoryRequirements(vulkan->device, depthBuffer->depthImage, &memReq);
-    if (!vulkan_buffer_allocate(
-            vulkan->device,
-            memReq,
-            &vulkan->memProps,
-            VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
-            &depthBuffer->depthMemory)) {
-        CERROR("Faield to allocate depth buffer memory");
+    vkGetImageMemoryRequirements(vulkan->device, *image, &memReq);
+    *lazy = transient && vulkan_buffer_allocate(
+                             vulkan,
+                             memReq,
+                             VK_MEMORY_PROPERTY_LAZILY_ALLOCATED_BIT,
+                             category,
+                             memory);
+    if (!*lazy && !vulkan_buffer_allocate(
+                      vulkan,
+                      memReq,
+                      VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                      category,
+                      memory)) {
+        CERROR("Faield to allocate attachment memory");
+        return false;
+    }
+
+    result = vkBindImageMemory(vulkan->device, *image, *memory, 0);
+    CHECKVK(result, "Failed to bind attachment memory");
+    *allocated = memReq.size;
+    return true;
+}
+
+static bool vulkan_depth_buffer_create(VulkanState* vulkan, VkFormat depthFormat, VkExtent2D size, VkSampleCountFlagBits samples, bool transient, DepthBuffer* depthBuffer) {
+    if (!vulkan_attachment_image_create(
+            vulkan, depthFormat, size, samples,
+            VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT, transient, MEMORY_Depth,
+            &depthBuffer->depthImage, &depthBuffer->depthMemory, &depthBuffer->size, &depthBuffer->lazy)) {
+        CERROR("Failed to create depth buffer");
+        return false;
+    }
+    depthBuffer->state = IMAGE_STATE_UNDEFINED;
+    return true;
+}
+
+static bool vulkan_msaa_color_create(VulkanState* vulkan, VkFormat colorFormat, VkExtent2D size, VkSampleCountFlagBits samples, ColorBuffer* colorBuffer) {
+    if (!vulkan_attachment_image_create(
+            vulkan, colorFormat, size, samples,
+            VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT, true, MEMORY_Framebuffer,
+            &colorBuffer->colorImage, &colorBuffer->colorMemory, &colorBuffer->size, &colorBuffer->lazy)) {
+        CERROR("Failed to create MSAA color buffer");
         return false;
     }
 
-    result = vkBindImageMemory(vulkan->device, depthBuffer->depthImage, depthBuffer->depthMemory, 0);
-    CHECKVK(result, "Failed to bind depth buffer memory");
+    VkImageViewCreateInfo viewCI = {
+        .sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO,
+        .image = colorBuffer->colorImage,
+        .viewType = VK_IMAGE_VIEW_TYPE_2D,
+        .format = colorFormat,
+        .components.r = VK_COMPONENT_SWIZZLE_R,
+        .components.g = VK_COMPONENT_SWIZZLE_G,
+        .components.b = VK_COMPONENT_SWIZZLE_B,
+        .components.a = VK_COMPONENT_SWIZZLE_A,
+        .subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+        .subresourceRange.baseMipLevel = 0,
+        .subresourceRange.levelCount = 1,
+        .subresourceRange.baseArrayLayer = 0,
+        .subresourceRange.layerCount = 1};
+    VkResult result = vkCreateImageView(vulkan->device, &viewCI, vulkan->allocator, &colorBuffer->colorView);
+    CHECKVK(result, "Failed to create MSAA color view");
+    colorBuffer->state = IMAGE_STATE_UNDEFINED;
     return true;
 }
 
-static bool vulkan_render_pass_create(VulkanState* vulkan, VkFormat color, VkFormat depth, RenderPass* rp) {
+static VkSampleCountFlagBits vulkan_select_sample_count(VulkanState* vulkan, uint32_t requested) {
+    VkSampleCountFlags supported = vulkan->limits.framebufferColorSampleCounts & vulkan->limits.framebufferDepthSampleCounts;
+
+    uint32_t samples = 1;
+    while ((samples << 1) <= requested && samples < VK_SAMPLE_COUNT_64_BIT) {
+        samples <<= 1;
+    }
+    while (samples > 1 && !(supported & samples)) {
+        samples >>= 1;
+    }
+    return (VkSampleCountFlagBits)samples;
+}
+
+// NOTE: both attachments are cleared on load, so their previous contents are discarded (initialLayout UNDEFINED).
+//       With samples > 1 color and depth stay on tile and only the resolve attachment is written back.
+static bool vulkan_render_pass_create(VulkanState* vulkan, VkFormat color, VkFormat depth, VkSampleCountFlagBits samples, bool storeDepth, FoveationMode foveation, RenderPass* rp) {
     rp->colorFmt = color;
     rp->depthFmt = depth;
+    rp->samples = samples;
+    rp->storeDepth = storeDepth;
+    rp->densityMap = foveation == FOVEATION_Runtime || foveation == FOVEATION_DensityMap;
+    rp->shadingRate = foveation == FOVEATION_ShadingRate;
     VkAttachmentReference colorRef = {
         .attachment = 0,
         .layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL};
     VkAttachmentReference depthRef = {
         .attachment = 1,
         .layout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL};
+    VkAttachmentReference resolveRef = {
+        .attachment = 2,
+        .layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL};
 
-    VkAttachmentDescription attachments[2];
+    VkAttachmentDescription attachments[4];
     uint32_t attachmentCount = 0;
 
     VkSubpassDescription subpass = {
@@ -1500,12 +3331,12 @@ static bool vulkan_render_pass_create(VulkanState* vulkan, VkFormat color, VkFor
         colorRef.attachment = attachmentCount++;
         attachments[colorRef.attachment] = (VkAttachmentDescription){
             .format = color,
-            .samples = VK_SAMPLE_COUNT_1_BIT,
+            .samples = samples,
             .loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR,
-            .storeOp = VK_ATTACHMENT_STORE_OP_STORE,
+            .storeOp = samples > VK_SAMPLE_COUNT_1_BIT ? VK_ATTACHMENT_STORE_OP_DONT_CARE : VK_ATTACHMENT_STORE_OP_STORE,
             .stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE,
             .stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE,
-            .initialLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
+            .initialLayout = VK_IMAGE_LAYOUT_UNDEFINED,
             .finalLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL};
 
         subpass.colorAttachmentCount = 1;
@@ -1517,31 +3348,200 @@ static bool vulkan_render_pass_create(VulkanState* vulkan, VkFormat color, VkFor
 
         attachments[depthRef.attachment] = (VkAttachmentDescription){
             .format = depth,
-            .samples = VK_SAMPLE_COUNT_1_BIT,
+            .samples = samples,
             .loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR,
-            .storeOp = VK_ATTACHMENT_STORE_OP_STORE,
+            .storeOp = storeDepth ? VK_ATTACHMENT_STORE_OP_STORE : VK_ATTACHMENT_STORE_OP_DONT_CARE,
             .stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE,
             .stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE,
-            .initialLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL,
+            .initialLayout = VK_IMAGE_LAYOUT_UNDEFINED,
             .finalLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL};
 
         subpass.pDepthStencilAttachment = &depthRef;
     }
 
+    if (color != VK_FORMAT_UNDEFINED && samples > VK_SAMPLE_COUNT_1_BIT) {
+        resolveRef.attachment = attachmentCount++;
+        attachments[resolveRef.attachment] = (VkAttachmentDescription){
+            .format = color,
+            .samples = VK_SAMPLE_COUNT_1_BIT,
+            .loadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE,
+            .storeOp = VK_ATTACHMENT_STORE_OP_STORE,
+            .stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE,
+            .stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE,
+            .initialLayout = VK_IMAGE_LAYOUT_UNDEFINED,
+            .finalLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL};
+
+        subpass.pResolveAttachments = &resolveRef;
+    }
+
+#if defined(VK_EXT_fragment_density_map)
+    // NOTE: the map stays in this layout, the pass only reads it
+    VkRenderPassFragmentDensityMapCreateInfoEXT densityCI = {
+        .sType = VK_STRUCTURE_TYPE_RENDER_PASS_FRAGMENT_DENSITY_MAP_CREATE_INFO_EXT,
+        .fragmentDensityMapAttachment = {
+            .attachment = attachmentCount,
+            .layout = VK_IMAGE_LAYOUT_FRAGMENT_DENSITY_MAP_OPTIMAL_EXT}};
+    if (rp->densityMap) {
+        attachments[attachmentCount++] = (VkAttachmentDescription){
+            .format = FOVEATION_DENSITY_FORMAT,
+            .samples = VK_SAMPLE_COUNT_1_BIT,
+            .loadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE,
+            .storeOp = VK_ATTACHMENT_STORE_OP_DONT_CARE,
+            .stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE,
+            .stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE,
+            .initialLayout = VK_IMAGE_LAYOUT_FRAGMENT_DENSITY_MAP_OPTIMAL_EXT,
+            .finalLayout = VK_IMAGE_LAYOUT_FRAGMENT_DENSITY_MAP_OPTIMAL_EXT};
+    }
+#endif
+
+#if defined(VK_KHR_fragment_shading_rate)
+    // NOTE: shading rate attachments only exist in the renderpass2 structs, so this pass is translated to them
+    if (rp->shadingRate) {
+        VkAttachmentDescription2KHR attachments2[4];
+        for (uint32_t i = 0; i < attachmentCount; ++i) {
+            attachments2[i] = (VkAttachmentDescription2KHR){
+                .sType = VK_STRUCTURE_TYPE_ATTACHMENT_DESCRIPTION_2_KHR,
+                .format = attachments[i].format,
+                .samples = attachments[i].samples,
+                .loadOp = attachments[i].loadOp,
+                .storeOp = attachments[i].storeOp,
+                .stencilLoadOp = attachments[i].stencilLoadOp,
+                .stencilStoreOp = attachments[i].stencilStoreOp,
+                .initialLayout = attachments[i].initialLayout,
+                .finalLayout = attachments[i].finalLayout};
+        }
+        VkAttachmentReference2KHR rateRef = {
+            .sType = VK_STRUCTURE_TYPE_ATTACHMENT_REFERENCE_2_KHR,
+            .attachment = attachmentCount,
+            .layout = VK_IMAGE_LAYOUT_FRAGMENT_SHADING_RATE_ATTACHMENT_OPTIMAL_KHR};
+        attachments2[attachmentCount++] = (VkAttachmentDescription2KHR){
+            .sType = VK_STRUCTURE_TYPE_ATTACHMENT_DESCRIPTION_2_KHR,
+            .format = SHADING_RATE_FORMAT,
+            .samples = VK_SAMPLE_COUNT_1_BIT,
+            .loadOp = VK_ATTACHMENT_LOAD_OP_LOAD,
+            .storeOp = VK_ATTACHMENT_STORE_OP_STORE,  // NOTE: DONT_CARE would allow the contents to be discarded
+            .stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE,
+            .stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE,
+            .initialLayout = VK_IMAGE_LAYOUT_FRAGMENT_SHADING_RATE_ATTACHMENT_OPTIMAL_KHR,
+            .finalLayout = VK_IMAGE_LAYOUT_FRAGMENT_SHADING_RATE_ATTACHMENT_OPTIMAL_KHR};
+
+        VkAttachmentReference2KHR colorRef2 = {
+            .sType = VK_STRUCTURE_TYPE_ATTACHMENT_REFERENCE_2_KHR,
+            .attachment = colorRef.attachment,
+            .layout = colorRef.layout,
+            .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT};
+        VkAttachmentReference2KHR depthRef2 = {
+            .sType = VK_STRUCTURE_TYPE_ATTACHMENT_REFERENCE_2_KHR,
+            .attachment = depthRef.attachment,
+            .layout = depthRef.layout,
+            .aspectMask = VK_IMAGE_ASPECT_DEPTH_BIT};
+        VkAttachmentReference2KHR resolveRef2 = {
+            .sType = VK_STRUCTURE_TYPE_ATTACHMENT_REFERENCE_2_KHR,
+            .attachment = resolveRef.attachment,
+            .layout = resolveRef.layout,
+            .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT};
+        VkFragmentShadingRateAttachmentInfoKHR rateInfo = {
+            .sType = VK_STRUCTURE_TYPE_FRAGMENT_SHADING_RATE_ATTACHMENT_INFO_KHR,
+            .pFragmentShadingRateAttachment = &rateRef,
+            .shadingRateAttachmentTexelSize = vulkan->shadingRateTexel};
+        VkSubpassDescription2KHR subpass2 = {
+            .sType = VK_STRUCTURE_TYPE_SUBPASS_DESCRIPTION_2_KHR,
+            .pNext = &rateInfo,
+            .pipelineBindPoint = subpass.pipelineBindPoint,
+            .colorAttachmentCount = subpass.colorAttachmentCount,
+            .pColorAttachments = subpass.pColorAttachments ? &colorRef2 : 0,
+            .pResolveAttachments = subpass.pResolveAttachments ? &resolveRef2 : 0,
+            .pDepthStencilAttachment = subpass.pDepthStencilAttachment ? &depthRef2 : 0};
+        VkRenderPassCreateInfo2KHR rpCI2 = {
+            .sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO_2_KHR,
+            .subpassCount = 1,
+            .pSubpasses = &subpass2,
+            .attachmentCount = attachmentCount,
+            .pAttachments = attachments2};
+
+        VkResult result = vulkan->createRenderPass2(vulkan->device, &rpCI2, vulkan->allocator, &rp->pass);
+        CHECKVK(result, "Failed to create shading rate Render pass");
+        return true;
+    }
+#endif
+
     VkRenderPassCreateInfo rpCI = {
         .sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO,
         .subpassCount = 1,
         .pSubpasses = &subpass,
         .attachmentCount = attachmentCount,
         .pAttachments = attachments};
+#if defined(VK_EXT_fragment_density_map)
+    if (rp->densityMap) {
+        vulkan_chain_append(&rpCI, &densityCI);
+    }
+#endif
 
-    VkResult result = vkCreateRenderPass(vulkan->device, &rpCI, 0, &rp->pass);
+    VkResult result = vkCreateRenderPass(vulkan->device, &rpCI, vulkan->allocator, &rp->pass);
     CHECKVK(result, "Failed to create Render pass");
 
     return true;
 }
 
-static bool vulkan_pipeline_create(VulkanState* vulkan, VkExtent2D extent, RenderPass* rp, VkPrimitiveTopology topology, VkPipeline* pipe) {
+// NOTE: the pass handle is part of the pipeline key, so views that share a pass share their pipelines
+static bool vulkan_render_pass_get(VulkanState* vulkan, VkFormat color, VkFormat depth, VkSampleCountFlagBits samples, bool storeDepth, FoveationMode foveation, RenderPass* rp) {
+    bool densityMap = foveation == FOVEATION_Runtime || foveation == FOVEATION_DensityMap;
+    bool shadingRate = foveation == FOVEATION_ShadingRate;
+    for (uint32_t i = 0; i < vulkan->renderPassCount; ++i) {
+        RenderPass* cached = &vulkan->renderPasses[i];
+        if (cached->colorFmt == color && cached->depthFmt == depth && cached->samples == samples &&
+            cached->storeDepth == storeDepth && cached->densityMap == densityMap && cached->shadingRate == shadingRate) {
+            *rp = *cached;
+            return true;
+        }
+    }
+
+    if (vulkan->renderPassCount >= MAX_RENDER_PASSES) {
+        CERROR("Too many render passes, %u max", MAX_RENDER_PASSES);
+        return false;
+    }
+    RenderPass* created = &vulkan->renderPasses[vulkan->renderPassCount];
+    if (!vulkan_render_pass_create(vulkan, color, depth, samples, storeDepth, foveation, created)) {
+        return false;
+    }
+    ++vulkan->renderPassCount;
+    *rp = *created;
+    return true;
+}
+
+// NOTE: the defaults every pass starts from, callers adjust the fields they need before the lookup
+static void vulkan_pipeline_key(VulkanState* vulkan, const RenderPass* rp, VkPrimitiveTopology topology, const ShaderVariant* variant, PipelineKey* key) {
+    memset(key, 0, sizeof(*key));  // NOTE: padding included
+    key->variant = *variant;
+    key->topology = topology;
+    key->cullMode = VK_CULL_MODE_BACK_BIT;
+    key->blendEnable = VK_FALSE;
+    key->depthTest = VK_TRUE;
+    key->depthWrite = VK_TRUE;
+    key->depthCompare = vulkan->depth.reverseZ ? VK_COMPARE_OP_GREATER : VK_COMPARE_OP_LESS;
+    key->samples = rp->samples;
+    key->colorFmt = rp->colorFmt;
+    key->depthFmt = rp->depthFmt;
+    key->viewMask = 0;
+    key->shadingRate = rp->shadingRate;
+    key->pass = rp->pass;
+}
+
+// NOTE: parts is 0 for a complete pipeline, otherwise the VkGraphicsPipelineLibraryFlagsEXT of the library to build
+static bool vulkan_pipeline_create(VulkanState* vulkan, const PipelineKey* key, uint32_t parts, VkPipeline* pipe) {
+    VkSpecializationMapEntry specEntries[] = {
+        {.constantID = SPEC_INSTANCED, .offset = offsetof(ShaderVariant, instanced), .size = sizeof(VkBool32)}};
+    VkSpecializationInfo specInfo = {
+        .mapEntryCount = array_size(specEntries),
+        .pMapEntries = specEntries,
+        .dataSize = sizeof(ShaderVariant),
+        .pData = &key->variant};
+    VkPipelineShaderStageCreateInfo stages[NUM_PIPELINE_STAGES];
+    for (uint32_t i = 0; i < NUM_PIPELINE_STAGES; ++i) {
+        stages[i] = vulkan->shaderProgram[i];
+        stages[i].pSpecializationInfo = &specInfo;
+    }
+
     VkPipelineVertexInputStateCreateInfo vertexInputCI = {
         .sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO,
         .vertexBindingDescriptionCount = 1,
@@ -1552,13 +3552,13 @@ static bool vulkan_pipeline_create(VulkanState* vulkan, VkExtent2D extent, Rende
     VkPipelineInputAssemblyStateCreateInfo inputAssembleCI = {
         .sType = VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO,
         .primitiveRestartEnable = VK_FALSE,
-        .topology = topology,
+        .topology = key->topology,
     };
 
     VkPipelineRasterizationStateCreateInfo raserizerCI = {
         .sType = VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO,
         .polygonMode = VK_POLYGON_MODE_FILL,
-        .cullMode = VK_CULL_MODE_BACK_BIT,
+        .cullMode = key->cullMode,
         .frontFace = VK_FRONT_FACE_CLOCKWISE,
         .depthClampEnable = VK_FALSE,
         .rasterizerDiscardEnable = VK_FALSE,
@@ -1569,9 +3569,9 @@ static bool vulkan_pipeline_create(VulkanState* vulkan, VkExtent2D extent, Rende
         .lineWidth = 1.0f};
 
     VkPipelineColorBlendAttachmentState colorBlendAttachmentState = {
-        .blendEnable = 0,
-        .srcColorBlendFactor = VK_BLEND_FACTOR_ONE,
-        .dstColorBlendFactor = VK_BLEND_FACTOR_ZERO,
+        .blendEnable = key->blendEnable,
+        .srcColorBlendFactor = key->blendEnable ? VK_BLEND_FACTOR_SRC_ALPHA : VK_BLEND_FACTOR_ONE,
+        .dstColorBlendFactor = key->blendEnable ? VK_BLEND_FACTOR_ONE_MINUS_SRC_ALPHA : VK_BLEND_FACTOR_ZERO,
         .colorBlendOp = VK_BLEND_OP_ADD,
         .srcAlphaBlendFactor = VK_BLEND_FACTOR_ONE,
         .dstAlphaBlendFactor = VK_BLEND_FACTOR_ZERO,
@@ -1590,59 +3590,535 @@ static bool vulkan_pipeline_create(VulkanState* vulkan, VkExtent2D extent, Rende
         .logicOp = VK_LOGIC_OP_NO_OP,
         .blendConstants = {1.0f, 1.0f, 1.0f, 1.0f}};
 
-    VkRect2D scissor = {{0, 0}, extent};
-    VkViewport viewport = {
-        0.0f,
-        0.0f,
-        (float)extent.width,
-        (float)extent.height,
-        0.0f,
-        1.0f};
-
+    // NOTE: set while recording, one pipeline serves every render size
     VkPipelineViewportStateCreateInfo viewportCI = {
         .sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO,
         .viewportCount = 1,
-        .pViewports = &viewport,
-        .scissorCount = 1,
-        .pScissors = &scissor};
+        .scissorCount = 1};
+
+    VkDynamicState dynamicStates[] = {
+        VK_DYNAMIC_STATE_VIEWPORT,
+        VK_DYNAMIC_STATE_SCISSOR};
+    VkPipelineDynamicStateCreateInfo dynamicStateCI = {
+        .sType = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO,
+        .dynamicStateCount = array_size(dynamicStates),
+        .pDynamicStates = dynamicStates};
+
+    VkPipelineDepthStencilStateCreateInfo depthStencilStateCI = {
+        .sType = VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO,
+        .depthTestEnable = key->depthTest,
+        .depthWriteEnable = key->depthWrite,
+        .depthCompareOp = key->depthCompare,
+        .depthBoundsTestEnable = VK_FALSE,
+        .stencilTestEnable = VK_FALSE,
+        .front = {
+            .failOp = VK_STENCIL_OP_KEEP,
+            .passOp = VK_STENCIL_OP_KEEP,
+            .depthFailOp = VK_STENCIL_OP_KEEP,
+            .compareOp = VK_COMPARE_OP_ALWAYS},
+        .back = {.failOp = VK_STENCIL_OP_KEEP, .passOp = VK_STENCIL_OP_KEEP, .depthFailOp = VK_STENCIL_OP_KEEP, .compareOp = VK_COMPARE_OP_ALWAYS},
+        .minDepthBounds = 0.0f,
+        .maxDepthBounds = 1.0f};
+
+    VkPipelineMultisampleStateCreateInfo multiSampleCI = {
+        .sType = VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO,
+        .rasterizationSamples = key->samples};
+
+#if defined(VK_KHR_dynamic_rendering)
+    VkPipelineRenderingCreateInfoKHR renderingCI = {
+        .sType = VK_STRUCTURE_TYPE_PIPELINE_RENDERING_CREATE_INFO_KHR,
+        .viewMask = key->viewMask,
+        .colorAttachmentCount = 1,
+        .pColorAttachmentFormats = &key->colorFmt,
+        .depthAttachmentFormat = key->depthFmt};
+#endif
+
+    VkGraphicsPipelineCreateInfo pipeCI = {
+        .sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO,
+        .stageCount = array_size(stages),
+        .pStages = stages,
+        .pVertexInputState = &vertexInputCI,
+        .pInputAssemblyState = &inputAssembleCI,
+        .pTessellationState = 0,
+        .pViewportState = &viewportCI,
+        .pRasterizationState = &raserizerCI,
+        .pMultisampleState = &multiSampleCI,
+        .pDepthStencilState = &depthStencilStateCI,
+        .pColorBlendState = &colorBlendStateCI,
+        .pDynamicState = &dynamicStateCI,
+        .layout = vulkan->pipelineLayout,
+        .renderPass = key->pass,
+        .subpass = 0};
+#if defined(VK_KHR_dynamic_rendering)
+    if (!key->pass) {
+        pipeCI.pNext = &renderingCI;
+    }
+#endif
+#if defined(VK_KHR_fragment_shading_rate)
+    // NOTE: the pipeline rate stays 1x1 and the attachment's rate replaces it
+    VkPipelineFragmentShadingRateStateCreateInfoKHR shadingRateCI = {
+        .sType = VK_STRUCTURE_TYPE_PIPELINE_FRAGMENT_SHADING_RATE_STATE_CREATE_INFO_KHR,
+        .fragmentSize = {.width = 1, .height = 1},
+        .combinerOps = {VK_FRAGMENT_SHADING_RATE_COMBINER_OP_KEEP_KHR, VK_FRAGMENT_SHADING_RATE_COMBINER_OP_REPLACE_KHR}};
+    if (key->shadingRate) {
+        vulkan_chain_append(&pipeCI, &shadingRateCI);
+    }
+#endif
+#if defined(VK_EXT_graphics_pipeline_library)
+    VkGraphicsPipelineLibraryCreateInfoEXT libraryCI = {
+        .sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_LIBRARY_CREATE_INFO_EXT,
+        .flags = parts};
+    if (parts) {
+        // NOTE: state outside the parts is ignored, only the stages have to match them
+        pipeCI.flags = VK_PIPELINE_CREATE_LIBRARY_BIT_KHR | VK_PIPELINE_CREATE_RETAIN_LINK_TIME_OPTIMIZATION_INFO_BIT_EXT;
+        pipeCI.stageCount = 0;
+        if (parts & VK_GRAPHICS_PIPELINE_LIBRARY_PRE_RASTERIZATION_SHADERS_BIT_EXT) {
+            stages[pipeCI.stageCount++] = stages[0];
+        }
+        if (parts & VK_GRAPHICS_PIPELINE_LIBRARY_FRAGMENT_SHADER_BIT_EXT) {
+            stages[pipeCI.stageCount++] = stages[1];
+        }
+        pipeCI.pStages = pipeCI.stageCount ? stages : 0;
+        vulkan_chain_append(&pipeCI, &libraryCI);
+    }
+#endif
+    VkResult result = vkCreateGraphicsPipelines(vulkan->device, vulkan->pipelines.driverCache, 1, &pipeCI, vulkan->allocator, pipe);
+    CHECKVK(result, "Failed to create Pipeline");
+    return true;
+}
+
+#if defined(VK_EXT_graphics_pipeline_library)
+static const uint32_t PIPELINE_LIBRARY_PART_BITS[PIPELINE_LIBRARY_PARTS] = {
+    VK_GRAPHICS_PIPELINE_LIBRARY_VERTEX_INPUT_INTERFACE_BIT_EXT,
+    VK_GRAPHICS_PIPELINE_LIBRARY_PRE_RASTERIZATION_SHADERS_BIT_EXT,
+    VK_GRAPHICS_PIPELINE_LIBRARY_FRAGMENT_SHADER_BIT_EXT,
+    VK_GRAPHICS_PIPELINE_LIBRARY_FRAGMENT_OUTPUT_INTERFACE_BIT_EXT};
+
+// NOTE: keep only the key fields the part is built from, so pipelines that differ elsewhere share it
+static void vulkan_pipeline_library_key(const PipelineKey* key, uint32_t part, PipelineKey* partKey) {
+    memset(partKey, 0, sizeof(*partKey));
+    partKey->viewMask = key->viewMask;
+    partKey->pass = key->pass;
+    switch (part) {
+        case VK_GRAPHICS_PIPELINE_LIBRARY_VERTEX_INPUT_INTERFACE_BIT_EXT: {
+            partKey->topology = key->topology;
+            partKey->viewMask = 0;
+            partKey->pass = VK_NULL_HANDLE;
+        } break;
+        case VK_GRAPHICS_PIPELINE_LIBRARY_PRE_RASTERIZATION_SHADERS_BIT_EXT: {
+            partKey->variant = key->variant;
+            partKey->cullMode = key->cullMode;
+            partKey->shadingRate = key->shadingRate;
+        } break;
+        case VK_GRAPHICS_PIPELINE_LIBRARY_FRAGMENT_SHADER_BIT_EXT: {
+            partKey->variant = key->variant;
+            partKey->depthTest = key->depthTest;
+            partKey->depthWrite = key->depthWrite;
+            partKey->depthCompare = key->depthCompare;
+            partKey->samples = key->samples;
+            partKey->shadingRate = key->shadingRate;
+        } break;
+        case VK_GRAPHICS_PIPELINE_LIBRARY_FRAGMENT_OUTPUT_INTERFACE_BIT_EXT: {
+            partKey->blendEnable = key->blendEnable;
+            partKey->samples = key->samples;
+            partKey->colorFmt = key->colorFmt;
+            partKey->depthFmt = key->depthFmt;
+        } break;
+    }
+}
+
+// NOTE: render thread only, libraries are built once and kept until cleanup
+static bool vulkan_pipeline_library_get(VulkanState* vulkan, const PipelineKey* key, uint32_t part, VkPipeline* lib) {
+    PipelineCache* cache = &vulkan->pipelines;
+    PipelineKey partKey;
+    vulkan_pipeline_library_key(key, part, &partKey);
+    uint64_t hash = hash_fnv1a(&partKey, sizeof(partKey)) ^ part;
+    for (uint32_t i = 0; i < MAX_PIPELINE_LIBRARIES; ++i) {
+        PipelineLibrary* library = &cache->libraries[(hash + i) & (MAX_PIPELINE_LIBRARIES - 1)];
+        if (library->lib && library->part == part && library->hash == hash && !memcmp(&library->key, &partKey, sizeof(partKey))) {
+            *lib = library->lib;
+            return true;
+        }
+        if (library->lib) {
+            continue;
+        }
+
+        uint64_t start = time_now_ns();
+        if (!vulkan_pipeline_create(vulkan, key, part, &library->lib)) {
+            library->lib = VK_NULL_HANDLE;
+            return false;
+        }
+        library->hash = hash;
+        library->part = part;
+        library->key = partKey;
+        ++cache->libraryCount;
+        CINFO("Pipeline library %016llx (part 0x%x) built in %.3f ms, %u libraries",
+              (unsigned long long)hash, part, (time_now_ns() - start) / 1000000.0, cache->libraryCount);
+        *lib = library->lib;
+        return true;
+    }
+
+    CERROR("Pipeline library cache is full (%u libraries)", MAX_PIPELINE_LIBRARIES);
+    return false;
+}
+
+static bool vulkan_pipeline_link(VulkanState* vulkan, const VkPipeline* libraries, bool optimize, VkPipeline* pipe) {
+    VkPipelineLibraryCreateInfoKHR linkCI = {
+        .sType = VK_STRUCTURE_TYPE_PIPELINE_LIBRARY_CREATE_INFO_KHR,
+        .libraryCount = PIPELINE_LIBRARY_PARTS,
+        .pLibraries = libraries};
+    VkGraphicsPipelineCreateInfo pipeCI = {
+        .sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO,
+        .pNext = &linkCI,
+        .flags = optimize ? VK_PIPELINE_CREATE_LINK_TIME_OPTIMIZATION_BIT_EXT : 0,
+        .layout = vulkan->pipelineLayout};
+    VkResult result = vkCreateGraphicsPipelines(vulkan->device, vulkan->pipelines.driverCache, 1, &pipeCI, vulkan->allocator, pipe);
+    CHECKVK(result, "Failed to link pipeline");
+    return true;
+}
+
+// NOTE: gets the entry drawable right away from its libraries, the workers then only have to optimize it
+static bool vulkan_pipeline_fast_link(VulkanState* vulkan, PipelineEntry* entry) {
+    for (uint32_t i = 0; i < PIPELINE_LIBRARY_PARTS; ++i) {
+        if (!vulkan_pipeline_library_get(vulkan, &entry->key, PIPELINE_LIBRARY_PART_BITS[i], &entry->libraries[i])) {
+            return false;
+        }
+    }
+
+    uint64_t start = time_now_ns();
+    if (!vulkan_pipeline_link(vulkan, entry->libraries, false, &entry->fastPipe)) {
+        entry->fastPipe = VK_NULL_HANDLE;
+        return false;
+    }
+    CINFO("Pipeline %016llx fast linked in %.3f ms", (unsigned long long)entry->hash, (time_now_ns() - start) / 1000000.0);
+    return true;
+}
+#endif
+
+static void* vulkan_pipeline_worker(void* arg) {
+    VulkanState* vulkan = (VulkanState*)arg;
+    PipelineCache* cache = &vulkan->pipelines;
+    PipelineCompiler* compiler = &cache->compiler;
+
+    pthread_mutex_lock(&compiler->lock);
+    for (;;) {
+        while (compiler->head == compiler->tail && !compiler->quit) {
+            pthread_cond_wait(&compiler->wake, &compiler->lock);
+        }
+        if (compiler->quit) {
+            break;
+        }
+        PipelineEntry* entry = &cache->entries[compiler->queue[compiler->head++ % MAX_PIPELINES]];
+        pthread_mutex_unlock(&compiler->lock);
+
+        uint64_t start = time_now_ns();
+        VkPipeline pipe = VK_NULL_HANDLE;
+        bool created;
+#if defined(VK_EXT_graphics_pipeline_library)
+        if (entry->fastPipe) {
+            created = vulkan_pipeline_link(vulkan, entry->libraries, true, &pipe);
+        } else
+#endif
+        {
+            created = vulkan_pipeline_create(vulkan, &entry->key, 0, &pipe);
+        }
+        uint64_t elapsed = time_now_ns() - start;
+
+        pthread_mutex_lock(&compiler->lock);
+        entry->pipe = pipe;
+        // NOTE: a failed optimized link keeps drawing with the fast linked pipeline
+        if (created || !entry->fastPipe) {
+            atomic_store_explicit(&entry->state, created ? PIPELINE_Ready : PIPELINE_Failed, memory_order_release);
+        }
+        cache->createNs += elapsed;
+        --compiler->busy;
+        CINFO("Pipeline %016llx %s in %.3f ms (%u queued, %.3f ms compiling in total)",
+              (unsigned long long)entry->hash, created ? "compiled" : "failed", elapsed / 1000000.0,
+              compiler->busy, cache->createNs / 1000000.0);
+        pthread_cond_broadcast(&compiler->idle);
+    }
+    pthread_mutex_unlock(&compiler->lock);
+    return 0;
+}
+
+static bool vulkan_pipeline_compiler_init(VulkanState* vulkan) {
+    PipelineCache* cache = &vulkan->pipelines;
+    if (cache->driverCache) {
+        return true;
+    }
+
+    VkPipelineCacheCreateInfo cacheCI = {
+        .sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO};
+    VkResult result = vkCreatePipelineCache(vulkan->device, &cacheCI, vulkan->allocator, &cache->driverCache);
+    CHECKVK(result, "Failed to create pipeline cache");
+
+    PipelineCompiler* compiler = &cache->compiler;
+    pthread_mutex_init(&compiler->lock, 0);
+    pthread_cond_init(&compiler->wake, 0);
+    pthread_cond_init(&compiler->idle, 0);
+    for (uint32_t i = 0; i < PIPELINE_WORKERS; ++i) {
+        if (pthread_create(&compiler->workers[i], 0, vulkan_pipeline_worker, vulkan)) {
+            CWARN("Failed to start pipeline worker %u", i);
+            break;
+        }
+        ++compiler->workerCount;
+    }
+    // NOTE: with no workers pipelines are compiled on the render thread when requested
+    CINFO("Pipeline compiler started with %u workers", compiler->workerCount);
+    return true;
+}
+
+static void vulkan_pipeline_compiler_shutdown(VulkanState* vulkan) {
+    PipelineCompiler* compiler = &vulkan->pipelines.compiler;
+    if (!vulkan->pipelines.driverCache) {
+        return;
+    }
+
+    pthread_mutex_lock(&compiler->lock);
+    compiler->quit = true;
+    pthread_cond_broadcast(&compiler->wake);
+    pthread_mutex_unlock(&compiler->lock);
+    for (uint32_t i = 0; i < compiler->workerCount; ++i) {
+        pthread_join(compiler->workers[i], 0);
+    }
+    compiler->workerCount = 0;
+    pthread_cond_destroy(&compiler->idle);
+    pthread_cond_destroy(&compiler->wake);
+    pthread_mutex_destroy(&compiler->lock);
+}
+
+// NOTE: finds the entry for the key or queues its compilation, never waits for a worker
+static PipelineEntry* vulkan_pipeline_request(VulkanState* vulkan, const PipelineKey* key) {
+    PipelineCache* cache = &vulkan->pipelines;
+    PipelineCompiler* compiler = &cache->compiler;
+    uint64_t hash = hash_fnv1a(key, sizeof(*key));
+    for (uint32_t i = 0; i < MAX_PIPELINES; ++i) {
+        uint32_t slot = (hash + i) & (MAX_PIPELINES - 1);
+        PipelineEntry* entry = &cache->entries[slot];
+        // NOTE: only this thread moves an entry out of Empty, so a relaxed load is enough here
+        uint32_t state = atomic_load_explicit(&entry->state, memory_order_relaxed);
+        if (state != PIPELINE_Empty && entry->hash == hash && !memcmp(&entry->key, key, sizeof(*key))) {
+            ++cache->hits;
+            return entry;
+        }
+        if (state != PIPELINE_Empty) {
+            continue;
+        }
+
+        entry->hash = hash;
+        entry->key = *key;
+        ++cache->count;
+        PipelineState queued = PIPELINE_Queued;
+#if defined(VK_EXT_graphics_pipeline_library)
+        if (vulkan->caps.graphicsPipelineLibrary && vulkan_pipeline_fast_link(vulkan, entry)) {
+            queued = PIPELINE_Linked;
+        }
+#endif
+        if (!compiler->workerCount) {
+            // NOTE: a fast linked pipeline is kept as is rather than optimized on the render thread
+            bool created = entry->fastPipe || vulkan_pipeline_create(vulkan, &entry->key, 0, &entry->pipe);
+            atomic_store_explicit(&entry->state, !created ? PIPELINE_Failed : entry->fastPipe ? PIPELINE_Linked : PIPELINE_Ready, memory_order_relaxed);
+            return entry;
+        }
+
+        atomic_store_explicit(&entry->state, queued, memory_order_relaxed);
+        pthread_mutex_lock(&compiler->lock);
+        compiler->queue[compiler->tail++ % MAX_PIPELINES] = slot;
+        ++compiler->busy;
+        pthread_cond_signal(&compiler->wake);
+        pthread_mutex_unlock(&compiler->lock);
+        return entry;
+    }
+
+    CERROR("Pipeline cache is full (%u pipelines)", MAX_PIPELINES);
+    return 0;
+}
+
+static VkPipeline vulkan_pipeline_ready(PipelineEntry* entry) {
+    if (!entry) {
+        return VK_NULL_HANDLE;
+    }
+    uint32_t state = atomic_load_explicit(&entry->state, memory_order_acquire);
+    if (state == PIPELINE_Ready) {
+        return entry->pipe;
+    }
+    return state == PIPELINE_Linked ? entry->fastPipe : VK_NULL_HANDLE;
+}
+
+static uint32_t vulkan_pipeline_pending(PipelineCache* cache) {
+    uint32_t pending = 0;
+    for (uint32_t i = 0; i < MAX_PIPELINES; ++i) {
+        pending += atomic_load_explicit(&cache->entries[i].state, memory_order_acquire) == PIPELINE_Queued ? 1 : 0;
+    }
+    return pending;
+}
+
+// NOTE: loading phase, waits until every requested pipeline can draw so the first visible frames don't skip,
+//       fast linked pipelines don't wait for their optimized link
+static bool vulkan_pipeline_warm(VulkanState* vulkan) {
+    PipelineCache* cache = &vulkan->pipelines;
+    PipelineCompiler* compiler = &cache->compiler;
+    uint64_t start = time_now_ns();
+    if (compiler->workerCount) {
+        pthread_mutex_lock(&compiler->lock);
+        while (vulkan_pipeline_pending(cache)) {
+            pthread_cond_wait(&compiler->idle, &compiler->lock);
+        }
+        pthread_mutex_unlock(&compiler->lock);
+    }
+
+    uint32_t failed = 0;
+    for (uint32_t i = 0; i < MAX_PIPELINES; ++i) {
+        failed += atomic_load_explicit(&cache->entries[i].state, memory_order_acquire) == PIPELINE_Failed ? 1 : 0;
+    }
+    CINFO("Pipeline warm up: %u pipelines ready, %u failed, waited %.3f ms",
+          cache->count - failed, failed, (time_now_ns() - start) / 1000000.0);
+    return failed == 0;
+}
+
+static uint32_t vulkan_format_size(VkFormat format) {
+    switch (format) {
+        case VK_FORMAT_R8_UINT:
+            return 1;
+        case VK_FORMAT_D16_UNORM:
+        case VK_FORMAT_R8G8_UNORM:
+            return 2;
+        case VK_FORMAT_X8_D24_UNORM_PACK32:
+        case VK_FORMAT_D24_UNORM_S8_UINT:
+        case VK_FORMAT_D32_SFLOAT:
+        case VK_FORMAT_R8G8B8A8_SRGB:
+        case VK_FORMAT_B8G8R8A8_SRGB:
+        case VK_FORMAT_R8G8B8A8_UNORM:
+        case VK_FORMAT_B8G8R8A8_UNORM:
+            return 4;
+        case VK_FORMAT_D32_SFLOAT_S8_UINT:
+            return 5;
+        default:
+            return 4;
+    }
+}
+
+// NOTE: rough tile write-back per eye per frame, the real numbers depend on framebuffer compression
+static void vulkan_log_pass_bandwidth(SwapchainImageContext* context, uint32_t view) {
+    double pixels = (double)context->size.width * context->size.height;
+    double colorStore = pixels * vulkan_format_size(context->rp.colorFmt) / (1024.0 * 1024.0);
+    double msaaStore = colorStore * (context->samples > VK_SAMPLE_COUNT_1_BIT ? context->samples : 0);
+    double depthStore = pixels * context->samples * vulkan_format_size(context->rp.depthFmt) / (1024.0 * 1024.0);
+    CINFO("View[%u] pass bandwidth: color store %.2f MB, MSAA color store %.2f MB (skipped), depth store %.2f MB (%s) per frame",
+          view, colorStore, msaaStore, depthStore, context->submitDepth ? "stored" : "skipped");
+    if (context->samples > VK_SAMPLE_COUNT_1_BIT) {
+        CINFO("View[%u] MSAA color memory: %llu bytes %s", view, (unsigned long long)context->msaaColor.size,
+              context->msaaColor.lazy ? "lazily allocated" : "device local");
+    }
+    CINFO("View[%u] depth memory: %llu bytes %s", view, (unsigned long long)context->depthBuffer.size,
+          context->depthBuffer.lazy ? "lazily allocated" : "device local");
+}
+
+// NOTE: with runtime foveation every image comes with its density map, enumerated through the chained struct
+static void vulkan_chain_swapchain_images(VulkanState* vulkan, SwapchainImageContext* context, uint32_t imageCount) {
+    for (uint32_t i = 0; i < imageCount; ++i) {
+        context->foveationImages[i] = (XrSwapchainImageFoveationVulkanFB){
+            .type = XR_TYPE_SWAPCHAIN_IMAGE_FOVEATION_VULKAN_FB};
+        context->swapchainImages[i] = (XrSwapchainImageVulkan2KHR){
+            .type = XR_TYPE_SWAPCHAIN_IMAGE_VULKAN2_KHR,
+            .next = vulkan->foveation == FOVEATION_Runtime ? &context->foveationImages[i] : 0};
+    }
+}
+
+// NOTE: one map per view covering the whole swapchain image, shared by all of its images since only the pass reads it.
+//       The contents are written when the view is next recorded.
+static bool vulkan_shading_map_create(VulkanState* vulkan, SwapchainImageContext* context) {
+    ShadingMap* map = &context->shadingMap;
+    VkImageUsageFlags usage = VK_IMAGE_USAGE_TRANSFER_DST_BIT;
+    switch (vulkan->foveation) {
+#if defined(VK_EXT_fragment_density_map)
+        case FOVEATION_DensityMap: {
+            map->format = FOVEATION_DENSITY_FORMAT;
+            map->texel = vulkan->densityTexel;
+            map->read = (ImageState){
+                .layout = VK_IMAGE_LAYOUT_FRAGMENT_DENSITY_MAP_OPTIMAL_EXT,
+                .stage = VK_PIPELINE_STAGE_FRAGMENT_DENSITY_PROCESS_BIT_EXT,
+                .access = VK_ACCESS_FRAGMENT_DENSITY_MAP_READ_BIT_EXT};
+            usage |= VK_IMAGE_USAGE_FRAGMENT_DENSITY_MAP_BIT_EXT;
+        } break;
+#endif
+#if defined(VK_KHR_fragment_shading_rate)
+        case FOVEATION_ShadingRate: {
+            map->format = SHADING_RATE_FORMAT;
+            map->texel = vulkan->shadingRateTexel;
+            map->read = (ImageState){
+                .layout = VK_IMAGE_LAYOUT_FRAGMENT_SHADING_RATE_ATTACHMENT_OPTIMAL_KHR,
+                .stage = VK_PIPELINE_STAGE_FRAGMENT_SHADING_RATE_ATTACHMENT_BIT_KHR,
+                .access = VK_ACCESS_FRAGMENT_SHADING_RATE_ATTACHMENT_READ_BIT_KHR};
+            usage |= VK_IMAGE_USAGE_FRAGMENT_SHADING_RATE_ATTACHMENT_BIT_KHR;
+        } break;
+#endif
+        default:
+            return true;
+    }
+
+    map->texel.width = map->texel.width ? map->texel.width : 1;
+    map->texel.height = map->texel.height ? map->texel.height : 1;
+    map->extent = (VkExtent2D){
+        .width = (context->size.width + map->texel.width - 1) / map->texel.width,
+        .height = (context->size.height + map->texel.height - 1) / map->texel.height};
+    bool lazy = false;
+    if (!vulkan_attachment_image_create(
+            vulkan, map->format, map->extent, VK_SAMPLE_COUNT_1_BIT,
+            usage, false, MEMORY_Texture,
+            &map->image, &map->memory, &map->size, &lazy)) {
+        CERROR("Failed to create foveation map");
+        return false;
+    }
+
+    VkImageViewCreateInfo viewCI = {
+        .sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO,
+        .image = map->image,
+        .viewType = VK_IMAGE_VIEW_TYPE_2D,
+        .format = map->format,
+        .subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+        .subresourceRange.baseMipLevel = 0,
+        .subresourceRange.levelCount = 1,
+        .subresourceRange.baseArrayLayer = 0,
+        .subresourceRange.layerCount = 1};
+    VkResult result = vkCreateImageView(vulkan->device, &viewCI, vulkan->allocator, &map->view);
+    CHECKVK(result, "Failed to create foveation map view");
+
+    VkBufferCreateInfo bufferCI = {
+        .sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
+        .usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+        .size = (VkDeviceSize)map->extent.width * map->extent.height * vulkan_format_size(map->format)};
+    result = vkCreateBuffer(vulkan->device, &bufferCI, vulkan->allocator, &map->staging);
+    CHECKVK(result, "Failed to create foveation map staging buffer");
 
-    VkPipelineDepthStencilStateCreateInfo depthStencilStateCI = {
-        .sType = VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO,
-        .depthTestEnable = VK_TRUE,
-        .depthWriteEnable = VK_TRUE,
-        .depthCompareOp = VK_COMPARE_OP_LESS,
-        .depthBoundsTestEnable = VK_FALSE,
-        .stencilTestEnable = VK_FALSE,
-        .front = {
-            .failOp = VK_STENCIL_OP_KEEP,
-            .passOp = VK_STENCIL_OP_KEEP,
-            .depthFailOp = VK_STENCIL_OP_KEEP,
-            .compareOp = VK_COMPARE_OP_ALWAYS},
-        .back = {.failOp = VK_STENCIL_OP_KEEP, .passOp = VK_STENCIL_OP_KEEP, .depthFailOp = VK_STENCIL_OP_KEEP, .compareOp = VK_COMPARE_OP_ALWAYS},
-        .minDepthBounds = 0.0f,
-        .maxDepthBounds = 1.0f};
+    VkMemoryRequirements memReq = {};
+    vkGetBufferMemoryRequirements(vulkan->device, map->staging, &memReq);
+    map->coherent = vulkan_buffer_allocate(
+        vulkan,
+        memReq,
+        VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+        MEMORY_Staging,
+        &map->stagingMemory);
+    if (!map->coherent && !vulkan_buffer_allocate(
+                              vulkan,
+                              memReq,
+                              VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT,
+                              MEMORY_Staging,
+                              &map->stagingMemory)) {
+        CERROR("Failed to allocate foveation map staging memory");
+        return false;
+    }
 
-    VkPipelineMultisampleStateCreateInfo multiSampleCI = {
-        .sType = VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO,
-        .rasterizationSamples = VK_SAMPLE_COUNT_1_BIT};
+    result = vkBindBufferMemory(vulkan->device, map->staging, map->stagingMemory, 0);
+    CHECKVK(result, "Failed to bind foveation map staging memory");
 
-    VkGraphicsPipelineCreateInfo pipeCI = {
-        .sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO,
-        .stageCount = array_size(vulkan->shaderProgram),
-        .pStages = vulkan->shaderProgram,
-        .pVertexInputState = &vertexInputCI,
-        .pInputAssemblyState = &inputAssembleCI,
-        .pTessellationState = 0,
-        .pViewportState = &viewportCI,
-        .pRasterizationState = &raserizerCI,
-        .pMultisampleState = &multiSampleCI,
-        .pDepthStencilState = &depthStencilStateCI,
-        .pColorBlendState = &colorBlendStateCI,
-        .layout = vulkan->pipelineLayout,
-        .renderPass = rp->pass,
-        .subpass = 0};
-    VkResult result = vkCreateGraphicsPipelines(vulkan->device, 0, 1, &pipeCI, 0, pipe);
-    CHECKVK(result, "Failed to create Pipeline");
+    result = vkMapMemory(vulkan->device, map->stagingMemory, 0, VK_WHOLE_SIZE, 0, (void**)&map->mapped);
+    CHECKVK(result, "Failed to map foveation map staging memory");
+
+    map->state = IMAGE_STATE_UNDEFINED;
+    map->generatedLevel = UINT32_MAX;
+    CINFO("Foveation map: %ux%u texels of %ux%u pixels, %s", map->extent.width, map->extent.height,
+          map->texel.width, map->texel.height, FOVEATION_MODE_STR[vulkan->foveation]);
     return true;
 }
 
@@ -1653,29 +4129,174 @@ static XrSwapchainImageBaseHeader* vulkan_allocate_swapchain_images(VulkanState*
     this->size.width = swapchainCI->width;
     this->size.height = swapchainCI->height;
     VkFormat colorFormat = (VkFormat)swapchainCI->format;
-    VkFormat depthFormat = VK_FORMAT_D32_SFLOAT;
+    VkFormat depthFormat = vulkan->depth.format;
 
-    if (!vulkan_depth_buffer_create(vulkan, depthFormat, swapchainCI, &this->depthBuffer)) {
+    if (!vulkan_depth_buffer_create(vulkan, depthFormat, this->size, this->samples, !this->submitDepth, &this->depthBuffer)) {
         CERROR("Faield to creaate depth buffer, View[%u] ", viewID);
         return 0;
     }
 
-    if (!vulkan_render_pass_create(vulkan, colorFormat, depthFormat, &this->rp)) {
+    if (this->samples > VK_SAMPLE_COUNT_1_BIT && !vulkan_msaa_color_create(vulkan, colorFormat, this->size, this->samples, &this->msaaColor)) {
+        CERROR("Faield to creaate MSAA color buffer, View[%u] ", viewID);
+        return 0;
+    }
+
+    if (!vulkan_shading_map_create(vulkan, this)) {
+        CERROR("Faield to creaate foveation map, View[%u] ", viewID);
+        return 0;
+    }
+
+    if (vulkan->caps.dynamicRendering) {
+        // NOTE: no render pass object, the pipeline and the command buffer only need the formats
+        this->rp.colorFmt = colorFormat;
+        this->rp.depthFmt = depthFormat;
+        this->rp.samples = this->samples;
+        this->rp.pass = VK_NULL_HANDLE;
+    } else if (!vulkan_render_pass_get(vulkan, colorFormat, depthFormat, this->samples, this->submitDepth, vulkan->foveation, &this->rp)) {
         CERROR("Faield to creaate render pass, View[%u] ", viewID);
         return 0;
     }
 
-    if (!vulkan_pipeline_create(vulkan, this->size, &this->rp, this->topology, &this->pipe)) {
+    ShaderVariant variant = {
+        .instanced = VK_TRUE};
+    PipelineKey key;
+    vulkan_pipeline_key(vulkan, &this->rp, this->topology, &variant, &key);
+    this->pipeline = vulkan_pipeline_request(vulkan, &key);
+    if (!this->pipeline) {
         CERROR("Faield to creaate pipeline, View[%u] ", viewID);
         return 0;
     }
 
-    for (uint32_t i = 0; i < imageCount; ++i) {
-        this->swapchainImages[i].type = XR_TYPE_SWAPCHAIN_IMAGE_VULKAN2_KHR;
+    // NOTE: the runtime doesn't promise a winding for the hidden triangles
+    if (vulkan->hiddenAreaMask) {
+        variant.instanced = VK_FALSE;
+        vulkan_pipeline_key(vulkan, &this->rp, VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST, &variant, &key);
+        key.cullMode = VK_CULL_MODE_NONE;
+        this->maskPipeline = vulkan_pipeline_request(vulkan, &key);
+        if (!this->maskPipeline) {
+            CERROR("Faield to creaate mask pipeline, View[%u] ", viewID);
+            return 0;
+        }
+    }
+
+    vulkan_chain_swapchain_images(vulkan, this, imageCount);
+    vulkan_log_pass_bandwidth(this, viewID);
+    return (XrSwapchainImageBaseHeader*)this->swapchainImages;
+}
+
+// NOTE: the render pass and pipeline only depend on formats and samples and viewport and scissor are dynamic,
+//       so a new size only needs new attachments, the old ones were retired by the caller
+static XrSwapchainImageBaseHeader* vulkan_resize_swapchain_images(VulkanState* vulkan, XrSwapchainCreateInfo* swapchainCI, uint32_t imageCount, uint32_t viewID) {
+    SwapchainImageContext* this = &vulkan->swapchainImageContext[viewID];
+    this->imageCount = imageCount;
+    this->size.width = swapchainCI->width;
+    this->size.height = swapchainCI->height;
+
+    if (!vulkan_depth_buffer_create(vulkan, this->rp.depthFmt, this->size, this->samples, !this->submitDepth, &this->depthBuffer)) {
+        CERROR("Failed to resize depth buffer, View[%u]", viewID);
+        return 0;
+    }
+
+    if (this->samples > VK_SAMPLE_COUNT_1_BIT && !vulkan_msaa_color_create(vulkan, this->rp.colorFmt, this->size, this->samples, &this->msaaColor)) {
+        CERROR("Failed to resize MSAA color buffer, View[%u]", viewID);
+        return 0;
+    }
+
+    if (!vulkan_shading_map_create(vulkan, this)) {
+        CERROR("Failed to resize foveation map, View[%u]", viewID);
+        return 0;
     }
+
+    vulkan_chain_swapchain_images(vulkan, this, imageCount);
+    vulkan_log_pass_bandwidth(this, viewID);
     return (XrSwapchainImageBaseHeader*)this->swapchainImages;
 }
 
+static float program_read_resolution_scale() {
+    char value[PROP_VALUE_MAX] = {0};
+    if (__system_property_get(RESOLUTION_SCALE_PROPERTY, value) <= 0) {
+        return RESOLUTION_SCALE;
+    }
+
+    float scale = strtof(value, 0);
+    if (!(scale > 0.0f)) {
+        CWARN("Ignoring %s=%s", RESOLUTION_SCALE_PROPERTY, value);
+        return RESOLUTION_SCALE;
+    }
+    return scale < MIN_RESOLUTION_SCALE ? MIN_RESOLUTION_SCALE : (scale > MAX_RESOLUTION_SCALE ? MAX_RESOLUTION_SCALE : scale);
+}
+
+// NOTE: the recommended size times the resolution scale, clamped to what the runtime allows for the view
+static XrExtent2Di program_swapchain_size(OpenXrProgram* program, uint32_t view) {
+    XrViewConfigurationView* config = &program->configViews[view];
+    int32_t width = (int32_t)(config->recommendedImageRectWidth * program->resolutionScale + 0.5f);
+    int32_t height = (int32_t)(config->recommendedImageRectHeight * program->resolutionScale + 0.5f);
+    width = width < 1 ? 1 : (width > (int32_t)config->maxImageRectWidth ? (int32_t)config->maxImageRectWidth : width);
+    height = height < 1 ? 1 : (height > (int32_t)config->maxImageRectHeight ? (int32_t)config->maxImageRectHeight : height);
+    return (XrExtent2Di){width, height};
+}
+
+static XrSwapchainCreateInfo program_swapchain_ci(OpenXrProgram* program, XrExtent2Di size) {
+    // NOTE: the swapchain stays single sampled, MSAA is resolved into it at the end of the pass
+    return (XrSwapchainCreateInfo){
+        .type = XR_TYPE_SWAPCHAIN_CREATE_INFO,
+        .next = program->foveation.runtime ? &program->foveation.swapchainCI : 0,
+        .arraySize = 1,
+        .format = program->colorSwapchainFormat,
+        .width = size.width,
+        .height = size.height,
+        .mipCount = 1,
+        .faceCount = 1,
+        .sampleCount = 1,
+        .usageFlags = XR_SWAPCHAIN_USAGE_SAMPLED_BIT | XR_SWAPCHAIN_USAGE_COLOR_ATTACHMENT_BIT};
+}
+
+// NOTE: a profile only carries the settings, the swapchains keep them after it is destroyed
+static bool program_update_foveation_profile(OpenXrProgram* program, XrFoveationLevelFB level) {
+    Foveation* foveation = &program->foveation;
+    XrFoveationLevelProfileCreateInfoFB levelCI = {
+        .type = XR_TYPE_FOVEATION_LEVEL_PROFILE_CREATE_INFO_FB,
+        .level = level,
+        .verticalOffset = 0.0f,
+        .dynamic = FOVEATION_DYNAMIC ? XR_FOVEATION_DYNAMIC_LEVEL_ENABLED_FB : XR_FOVEATION_DYNAMIC_DISABLED_FB};
+    XrFoveationProfileCreateInfoFB profileCI = {
+        .type = XR_TYPE_FOVEATION_PROFILE_CREATE_INFO_FB,
+        .next = &levelCI};
+    XrFoveationProfileFB profile = XR_NULL_HANDLE;
+    XrResult result = foveation->createProfile(program->session, &profileCI, &profile);
+    CHECKXR(result, "Failed to create foveation profile");
+
+    for (uint32_t i = 0; i < NUM_VIEWES && XR_SUCCEEDED(result); ++i) {
+        if (program->swapchains[i].handle) {
+            XrSwapchainStateFoveationFB state = {
+                .type = XR_TYPE_SWAPCHAIN_STATE_FOVEATION_FB,
+                .profile = profile};
+            result = foveation->updateSwapchain(program->swapchains[i].handle, (XrSwapchainStateBaseHeaderFB*)&state);
+        }
+    }
+    foveation->destroyProfile(profile);
+    CHECKXR(result, "Failed to apply foveation level %s", FOVEATION_LEVEL_STR[level]);
+    return true;
+}
+
+// NOTE: the generated maps pick the level up the next time each view is recorded
+static bool program_apply_foveation(OpenXrProgram* program, VulkanState* vulkan, XrFoveationLevelFB level) {
+    Foveation* foveation = &program->foveation;
+    if (!foveation->enabled) {
+        return true;
+    }
+
+    if (foveation->runtime && !program_update_foveation_profile(program, level)) {
+        return false;
+    }
+    vulkan->foveationLevel = level;
+
+    CDEBUG("Foveation level %s -> %s%s", FOVEATION_LEVEL_STR[foveation->level], FOVEATION_LEVEL_STR[level],
+           foveation->runtime && FOVEATION_DYNAMIC ? " (dynamic)" : "");
+    foveation->level = level;
+    return true;
+}
+
 static bool program_initialize_swapchains(OpenXrProgram* program, VulkanState* vulkan) {
     XrSystemProperties systemProperties = {
         .type = XR_TYPE_SYSTEM_PROPERTIES};
@@ -1690,6 +4311,26 @@ static bool program_initialize_swapchains(OpenXrProgram* program, VulkanState* v
     CINFO("  [%s] Orientation Tracking", systemProperties.trackingProperties.orientationTracking ? "V" : " ");
     CINFO("  [%s] Position Tracking", systemProperties.trackingProperties.positionTracking ? "V" : " ");
 
+    // NOTE: the mode was picked with the device features
+    program->foveation.enabled = vulkan->foveation != FOVEATION_Off;
+    program->foveation.runtime = vulkan->foveation == FOVEATION_Runtime;
+    vulkan->foveationLevel = program->foveation.level;
+    CINFO("Foveation: %s", FOVEATION_MODE_STR[vulkan->foveation]);
+
+    vulkan->hiddenAreaMask = program->caps.visibilityMask;
+    program->visibilityMaskStale = program->caps.visibilityMask ? (1u << NUM_VIEWES) - 1 : 0;
+
+    // NOTE: the maps are render pass attachments, dynamic rendering would need a separate pipeline flavour for them
+    if (program->foveation.enabled && vulkan->caps.dynamicRendering) {
+        CINFO("Foveation uses render passes, dynamic rendering disabled");
+        vulkan->caps.dynamicRendering = false;
+    }
+
+    if (!vulkan_pipeline_compiler_init(vulkan)) {
+        CERROR("Failed to start the pipeline compiler");
+        return false;
+    }
+
     uint32_t viewCount;
     result = xrEnumerateViewConfigurationViews(
         program->instance,
@@ -1726,18 +4367,21 @@ static bool program_initialize_swapchains(OpenXrProgram* program, VulkanState* v
         CINFO("Selected swapchain format: %lld", program->colorSwapchainFormat);
         free(formats);
 
+        program->resolutionScale = program_read_resolution_scale();
+        program->lastSizePoll = time_now_ns();
+
         // NOTE: create swapchain
         for (uint32_t i = 0; i < viewCount; ++i) {
-            XrSwapchainCreateInfo swapchainCI = {
-                .type = XR_TYPE_SWAPCHAIN_CREATE_INFO,
-                .arraySize = 1,
-                .format = program->colorSwapchainFormat,
-                .width = program->configViews[i].recommendedImageRectWidth,
-                .height = program->configViews[i].recommendedImageRectHeight,
-                .mipCount = 1,
-                .faceCount = 1,
-                .sampleCount = program->configViews[i].recommendedSwapchainSampleCount,
-                .usageFlags = XR_SWAPCHAIN_USAGE_SAMPLED_BIT | XR_SWAPCHAIN_USAGE_COLOR_ATTACHMENT_BIT};
+            uint32_t requestedSamples = MSAA_SAMPLES ? MSAA_SAMPLES : program->configViews[i].recommendedSwapchainSampleCount;
+            if (requestedSamples != program->configViews[i].recommendedSwapchainSampleCount) {
+                CWARN("View[%u] MSAA_SAMPLES %u overrides the recommended %u",
+                      i, requestedSamples, program->configViews[i].recommendedSwapchainSampleCount);
+            }
+            vulkan->swapchainImageContext[i].samples = vulkan_select_sample_count(vulkan, requestedSamples);
+            CINFO("View[%u] MSAA %ux (runtime recommends %u)",
+                  i, vulkan->swapchainImageContext[i].samples, program->configViews[i].recommendedSwapchainSampleCount);
+
+            XrSwapchainCreateInfo swapchainCI = program_swapchain_ci(program, program_swapchain_size(program, i));
             program->swapchains[i].width = swapchainCI.width;
             program->swapchains[i].height = swapchainCI.height;
             result = xrCreateSwapchain(program->session, &swapchainCI, &program->swapchains[i].handle);
@@ -1746,6 +4390,10 @@ static bool program_initialize_swapchains(OpenXrProgram* program, VulkanState* v
             uint32_t imageCount;
             result = xrEnumerateSwapchainImages(program->swapchains[i].handle, 0, &imageCount, 0);
             CHECKXR(result, "Faield to get image count for swapchain %u", i);
+            if (imageCount > MAX_IMAGES) {
+                CERROR("Swapchain %u has %u images, only %u supported", i, imageCount, MAX_IMAGES);
+                return false;
+            }
 
             XrSwapchainImageBaseHeader* imagesBase = vulkan_allocate_swapchain_images(
                 vulkan,
@@ -1766,6 +4414,19 @@ static bool program_initialize_swapchains(OpenXrProgram* program, VulkanState* v
         }
     }
 
+    if (!program_apply_foveation(program, vulkan, program->foveation.level)) {
+        return false;
+    }
+
+    if (!vulkan_pipeline_warm(vulkan)) {
+        CERROR("Failed to compile the swapchain pipelines");
+        return false;
+    }
+
+    vulkan_memory_query_budget(vulkan);
+    vulkan_memory_check(vulkan);
+    vulkan_memory_report(vulkan, "swapchains ready");
+    vulkan_host_allocator_report(vulkan, "swapchains ready");
     return true;
 }
 
@@ -1851,6 +4512,13 @@ static bool program_poll_events(OpenXrProgram* program, bool* exitRenderLoop, bo
                 // TODO: LogActionSourceName(m_input.poseAction, "Pose");
                 // TODO: LogActionSourceName(m_input.vibrateAction, "Vibrate");
             } break;
+            case XR_TYPE_EVENT_DATA_VISIBILITY_MASK_CHANGED_KHR: {
+                XrEventDataVisibilityMaskChangedKHR* e = (XrEventDataVisibilityMaskChangedKHR*)event;
+                if (e->viewConfigurationType == program->viewConfigType && e->viewIndex < NUM_VIEWES) {
+                    CINFO("Visibility mask of view %u changed", e->viewIndex);
+                    program->visibilityMaskStale |= 1u << e->viewIndex;
+                }
+            } break;
             case XR_TYPE_EVENT_DATA_REFERENCE_SPACE_CHANGE_PENDING:
             default: {
                 CTRACE("Ignoring event type: %u", event->type);
@@ -1932,107 +4600,404 @@ static bool program_poll_actions(OpenXrProgram* program) {
     return true;
 }
 
-static bool vulkan_commandbuffer_reset(VulkanState* vulkan) {
-    if (vulkan->cmdBuffer.state != CBR_STATE_Initialized) {
-        if (vulkan->cmdBuffer.state != CBR_STATE_Executable) {
+static uint64_t vulkan_frame_sync_poll(VulkanState* vulkan) {
+    FrameSync* sync = &vulkan->frameSync;
+    if (sync->timeline) {
+        uint64_t value = 0;
+        if (vulkan->getSemaphoreCounterValue(vulkan->device, sync->timeline, &value) == VK_SUCCESS && value > sync->completed) {
+            sync->completed = value;
+        }
+        return sync->completed;
+    }
+
+    // NOTE: fence fallback, everything before the oldest unfinished submission has completed
+    uint64_t completed = sync->submitted;
+    for (uint32_t i = 0; i < NUM_VIEWES; ++i) {
+        CmdBuffer* cbr = &vulkan->cmdBuffer[i];
+        if (cbr->state != CBR_STATE_Executing) {
+            continue;
+        }
+        if (vkGetFenceStatus(vulkan->device, cbr->execFence) == VK_SUCCESS) {
+            cbr->state = CBR_STATE_Executable;
+        } else if (cbr->submitValue - 1 < completed) {
+            completed = cbr->submitValue - 1;
+        }
+    }
+    if (completed > sync->completed) {
+        sync->completed = completed;
+    }
+    return sync->completed;
+}
+
+// NOTE: non blocking, true once the GPU has passed 'value'
+static bool vulkan_frame_sync_reached(VulkanState* vulkan, uint64_t value) {
+    return value <= vulkan->frameSync.completed || value <= vulkan_frame_sync_poll(vulkan);
+}
+
+static bool vulkan_frame_sync_wait(VulkanState* vulkan, uint64_t value, uint64_t timeoutNs) {
+    FrameSync* sync = &vulkan->frameSync;
+    if (value <= sync->completed) {
+        return true;
+    }
+
+    VkResult result;
+    if (sync->timeline) {
+        VkSemaphoreWaitInfoKHR waitInfo = {
+            .sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO_KHR,
+            .semaphoreCount = 1,
+            .pSemaphores = &sync->timeline,
+            .pValues = &value};
+        result = vulkan->waitSemaphores(vulkan->device, &waitInfo, timeoutNs);
+    } else {
+        VkFence fences[NUM_VIEWES];
+        uint32_t fenceCount = 0;
+        for (uint32_t i = 0; i < NUM_VIEWES; ++i) {
+            if (vulkan->cmdBuffer[i].state == CBR_STATE_Executing && vulkan->cmdBuffer[i].submitValue <= value) {
+                fences[fenceCount++] = vulkan->cmdBuffer[i].execFence;
+            }
+        }
+        result = fenceCount ? vkWaitForFences(vulkan->device, fenceCount, fences, VK_TRUE, timeoutNs) : VK_SUCCESS;
+    }
+
+    if (result == VK_TIMEOUT) {
+        CWARN("Timed out waiting for GPU to reach %llu (completed %llu)", (unsigned long long)value, (unsigned long long)sync->completed);
+        return false;
+    }
+    CHECKVK(result, "Failed to wait for frame sync value %llu", (unsigned long long)value);
+    vulkan_frame_sync_poll(vulkan);
+    if (value > sync->completed) {
+        sync->completed = value;
+    }
+    return true;
+}
+
+static void vulkan_destroy_handle(VulkanState* vulkan, DeferredDestroy* item) {
+    switch (item->type) {
+        case DESTROY_Buffer: {
+            vkDestroyBuffer(vulkan->device, item->handle.buffer, vulkan->allocator);
+        } break;
+        case DESTROY_Image: {
+            vkDestroyImage(vulkan->device, item->handle.image, vulkan->allocator);
+        } break;
+        case DESTROY_ImageView: {
+            vkDestroyImageView(vulkan->device, item->handle.imageView, vulkan->allocator);
+        } break;
+        case DESTROY_Framebuffer: {
+            vkDestroyFramebuffer(vulkan->device, item->handle.framebuffer, vulkan->allocator);
+        } break;
+        case DESTROY_RenderPass: {
+            vkDestroyRenderPass(vulkan->device, item->handle.renderPass, vulkan->allocator);
+        } break;
+        case DESTROY_Pipeline: {
+            vkDestroyPipeline(vulkan->device, item->handle.pipeline, vulkan->allocator);
+        } break;
+        case DESTROY_Memory: {
+            vulkan_memory_free(vulkan, &item->handle.memory);
+        } break;
+        case DESTROY_Swapchain: {
+            xrDestroySwapchain(item->handle.swapchain);
+        } break;
+    }
+}
+
+// NOTE: frees every retired handle whose last frame the GPU has passed, returns the number freed
+static uint32_t vulkan_deferred_collect(VulkanState* vulkan) {
+    DeferredDestroyQueue* queue = &vulkan->deferredDestroys;
+    if (!queue->count) {
+        return 0;
+    }
+
+    uint64_t completed = vulkan_frame_sync_poll(vulkan);
+    uint32_t kept = 0;
+    for (uint32_t i = 0; i < queue->count; ++i) {
+        if (queue->items[i].frame <= completed) {
+            vulkan_destroy_handle(vulkan, &queue->items[i]);
+        } else {
+            queue->items[kept++] = queue->items[i];
+        }
+    }
+    uint32_t freed = queue->count - kept;
+    queue->count = kept;
+    return freed;
+}
+
+// NOTE: hand a handle over for destruction once the frames that may still use it have finished
+static bool vulkan_defer_destroy(VulkanState* vulkan, DestroyType type, DestroyHandle handle) {
+    DeferredDestroyQueue* queue = &vulkan->deferredDestroys;
+    if (queue->count == MAX_DEFERRED_DESTROYS) {
+        vulkan_deferred_collect(vulkan);
+    }
+    if (queue->count == MAX_DEFERRED_DESTROYS) {
+        CWARN("Deferred destroy queue full, waiting for frame %llu", (unsigned long long)queue->items[0].frame);
+        if (!vulkan_frame_sync_wait(vulkan, queue->items[0].frame, GPU_WAIT_TIMEOUT_NS)) {
+            return false;
+        }
+        vulkan_deferred_collect(vulkan);
+    }
+
+    queue->items[queue->count++] = (DeferredDestroy){
+        .type = type,
+        .handle = handle,
+        .frame = vulkan->frameSync.submitted};
+    return true;
+}
+
+#define VKRETIRE(type, field, item)                                                         \
+    if (item) {                                                                             \
+        if (!vulkan_defer_destroy(vulkan, DESTROY_##type, (DestroyHandle){.field = item})) { \
+            return false;                                                                   \
+        }                                                                                   \
+        item = 0;                                                                           \
+    }
+
+// NOTE: everything a view renders into besides the swapchain images, released adds up the GPU memory handed back
+static bool vulkan_retire_view_targets(VulkanState* vulkan, SwapchainImageContext* context, VkDeviceSize* released, uint32_t* objects) {
+    for (uint32_t image = 0; image < context->imageCount; ++image) {
+        *objects += context->renderTarget[image].fb ? 1 : 0;
+        VKRETIRE(Framebuffer, framebuffer, context->renderTarget[image].fb);
+        VKRETIRE(ImageView, imageView, context->renderTarget[image].colorView);
+        VKRETIRE(ImageView, imageView, context->renderTarget[image].depthView);
+        VKRETIRE(ImageView, imageView, context->renderTarget[image].densityView);
+    }
+
+    if (context->depthBuffer.depthImage) {
+        *released += context->depthBuffer.size;
+        ++*objects;
+    }
+    VKRETIRE(Image, image, context->depthBuffer.depthImage);
+    VKRETIRE(Memory, memory, context->depthBuffer.depthMemory);
+    context->depthBuffer.state = IMAGE_STATE_UNDEFINED;
+    context->depthBuffer.size = 0;
+
+    if (context->msaaColor.colorImage) {
+        *released += context->msaaColor.size;
+        ++*objects;
+    }
+    VKRETIRE(ImageView, imageView, context->msaaColor.colorView);
+    VKRETIRE(Image, image, context->msaaColor.colorImage);
+    VKRETIRE(Memory, memory, context->msaaColor.colorMemory);
+    context->msaaColor.state = IMAGE_STATE_UNDEFINED;
+    context->msaaColor.size = 0;
+
+    if (context->shadingMap.image) {
+        *released += context->shadingMap.size;
+        ++*objects;
+    }
+    VKRETIRE(ImageView, imageView, context->shadingMap.view);
+    VKRETIRE(Image, image, context->shadingMap.image);
+    VKRETIRE(Memory, memory, context->shadingMap.memory);
+    VKRETIRE(Buffer, buffer, context->shadingMap.staging);
+    VKRETIRE(Memory, memory, context->shadingMap.stagingMemory);  // NOTE: freeing unmaps it
+    context->shadingMap.mapped = 0;
+    context->shadingMap.size = 0;
+    return true;
+}
+
+// NOTE: once the optimized pipeline is published the fast linked one only has to outlive the frames using it
+static bool vulkan_pipeline_retire_linked(VulkanState* vulkan) {
+    for (uint32_t i = 0; i < MAX_PIPELINES; ++i) {
+        PipelineEntry* entry = &vulkan->pipelines.entries[i];
+        if (!entry->fastPipe || atomic_load_explicit(&entry->state, memory_order_acquire) != PIPELINE_Ready) {
+            continue;
+        }
+        if (!vulkan_defer_destroy(vulkan, DESTROY_Pipeline, (DestroyHandle){.pipeline = entry->fastPipe})) {
+            return false;
+        }
+        entry->fastPipe = VK_NULL_HANDLE;
+    }
+    return true;
+}
+
+static bool vulkan_commandbuffer_reset(VulkanState* vulkan, CmdBuffer* cbr) {
+    if (cbr->state == CBR_STATE_Executing && vulkan_frame_sync_reached(vulkan, cbr->submitValue)) {
+        cbr->state = CBR_STATE_Executable;
+    }
+    // NOTE: a recording left behind by a failed frame is thrown away too
+    if (cbr->state != CBR_STATE_Initialized) {
+        if (cbr->state != CBR_STATE_Executable && cbr->state != CBR_STATE_Recording) {
             CERROR("Command buffer in unexpected state");
             return false;
         }
-        VkResult result = vkResetFences(vulkan->device, 1, &vulkan->cmdBuffer.execFence);
-        CHECKVK(result, "Failed to reset exec fence");
-        result = vkResetCommandBuffer(vulkan->cmdBuffer.buf, 0);
+        VkResult result;
+        if (!vulkan->frameSync.timeline) {
+            result = vkResetFences(vulkan->device, 1, &cbr->execFence);
+            CHECKVK(result, "Failed to reset exec fence");
+        }
+        result = vkResetCommandBuffer(cbr->buf, 0);
         CHECKVK(result, "Failed to reset commandbuffer");
 
-        vulkan->cmdBuffer.state = CBR_STATE_Initialized;
+        cbr->state = CBR_STATE_Initialized;
     }
     return true;
 }
 
-static bool vulkan_commandbuffer_begin(VulkanState* vulkan) {
-    if (vulkan->cmdBuffer.state != CBR_STATE_Initialized) {
+static bool vulkan_commandbuffer_begin(VulkanState* vulkan, CmdBuffer* cbr) {
+    if (cbr->state != CBR_STATE_Initialized) {
         CERROR("Command buffer in unexpected state");
         return false;
     }
     VkCommandBufferBeginInfo cmdBeginInfo = {
         .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO};
-    VkResult result = vkBeginCommandBuffer(vulkan->cmdBuffer.buf, &cmdBeginInfo);
+    VkResult result = vkBeginCommandBuffer(cbr->buf, &cmdBeginInfo);
     CHECKVK(result, "Failed to begin cbr");
-    vulkan->cmdBuffer.state = CBR_STATE_Recording;
+    cbr->state = CBR_STATE_Recording;
 
     return true;
 }
 
-static bool vulkan_commandbuffer_end(VulkanState* vulkan) {
-    if (vulkan->cmdBuffer.state != CBR_STATE_Recording) {
+static bool vulkan_commandbuffer_end(VulkanState* vulkan, CmdBuffer* cbr) {
+    if (cbr->state != CBR_STATE_Recording) {
         CERROR("Command buffer in unexpected state");
         return false;
     }
-    VkResult result = vkEndCommandBuffer(vulkan->cmdBuffer.buf);
+    VkResult result = vkEndCommandBuffer(cbr->buf);
     CHECKVK(result, "Failed to end cbr");
-    vulkan->cmdBuffer.state = CBR_STATE_Executable;
+    cbr->state = CBR_STATE_Executable;
     return true;
 }
 
-static bool vulkan_commandbuffer_exec(VulkanState* vulkan) {
-    if (vulkan->cmdBuffer.state != CBR_STATE_Executable) {
+static bool vulkan_commandbuffer_exec(VulkanState* vulkan, CmdBuffer* cbr) {
+    if (cbr->state != CBR_STATE_Executable) {
         CERROR("Command buffer in unexpected state");
         return false;
     }
+    uint64_t value = vulkan->frameSync.submitted + 1;
+    VkTimelineSemaphoreSubmitInfoKHR timelineSI = {
+        .sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO_KHR,
+        .signalSemaphoreValueCount = 1,
+        .pSignalSemaphoreValues = &value};
     VkSubmitInfo submitInfo = {
         .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
         .commandBufferCount = 1,
-        .pCommandBuffers = &vulkan->cmdBuffer.buf};
-    VkResult result = vkQueueSubmit(vulkan->queue, 1, &submitInfo, vulkan->cmdBuffer.execFence);
+        .pCommandBuffers = &cbr->buf};
+    VkFence fence = cbr->execFence;
+    if (vulkan->frameSync.timeline) {
+        submitInfo.pNext = &timelineSI;
+        submitInfo.signalSemaphoreCount = 1;
+        submitInfo.pSignalSemaphores = &vulkan->frameSync.timeline;
+        fence = VK_NULL_HANDLE;
+    }
+    VkResult result = vkQueueSubmit(vulkan->queue, 1, &submitInfo, fence);
     CHECKVK(result, "Failed to Submit queue");
-    vulkan->cmdBuffer.state = CBR_STATE_Executing;
+    vulkan->frameSync.submitted = value;
+    cbr->submitValue = value;
+    cbr->state = CBR_STATE_Executing;
     return true;
 }
 
-static bool vulkan_commandbuffer_wait(VulkanState* vulkan) {
-    if (vulkan->cmdBuffer.state == CBR_STATE_Initialized) {
+static bool vulkan_commandbuffer_wait(VulkanState* vulkan, CmdBuffer* cbr) {
+    // NOTE: a poll of the frame sync may already have retired this submission
+    if (cbr->state == CBR_STATE_Initialized || cbr->state == CBR_STATE_Executable) {
         return true;
     }
-    if (vulkan->cmdBuffer.state != CBR_STATE_Executing) {
+    if (cbr->state != CBR_STATE_Executing) {
         CERROR("Command buffer in unexpected state");
         return false;
     }
-    uint32_t timeoutNs = 1 * 1000 * 1000 * 1000;
-    for (uint32_t i = 0; i < 5; ++i) {
-        VkResult result = vkWaitForFences(vulkan->device, 1, &vulkan->cmdBuffer.execFence, VK_TRUE, timeoutNs);
-        if (result == VK_SUCCESS) {
-            vulkan->cmdBuffer.state = CBR_STATE_Executable;
-            return true;
+    if (!vulkan_frame_sync_wait(vulkan, cbr->submitValue, GPU_WAIT_TIMEOUT_NS)) {
+        return false;
+    }
+    cbr->state = CBR_STATE_Executable;
+    return true;
+}
+
+static void vulkan_barriers_flush(VulkanState* vulkan, CmdBuffer* cbr) {
+    if (!cbr->pendingBarrierCount) {
+        return;
+    }
+
+#if defined(VK_KHR_synchronization2)
+    if (vulkan->caps.synchronization2) {
+        VkImageMemoryBarrier2KHR barriers[MAX_PENDING_BARRIERS];
+        for (uint32_t i = 0; i < cbr->pendingBarrierCount; ++i) {
+            ImageBarrier* pending = &cbr->pendingBarriers[i];
+            barriers[i] = (VkImageMemoryBarrier2KHR){
+                .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER_2_KHR,
+                .srcStageMask = pending->src.stage,
+                .srcAccessMask = pending->src.access,
+                .dstStageMask = pending->dst.stage,
+                .dstAccessMask = pending->dst.access,
+                .oldLayout = pending->src.layout,
+                .newLayout = pending->dst.layout,
+                .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+                .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+                .image = pending->image,
+                .subresourceRange = {
+                    .aspectMask = pending->aspect,
+                    .baseMipLevel = 0,
+                    .levelCount = 1,
+                    .baseArrayLayer = 0,
+                    .layerCount = 1}};
         }
-        CWARN("WAit for CBR timed out");
+        VkDependencyInfoKHR dependencyInfo = {
+            .sType = VK_STRUCTURE_TYPE_DEPENDENCY_INFO_KHR,
+            .imageMemoryBarrierCount = cbr->pendingBarrierCount,
+            .pImageMemoryBarriers = barriers};
+        vulkan->cmdPipelineBarrier2(cbr->buf, &dependencyInfo);
+        cbr->pendingBarrierCount = 0;
+        return;
     }
-    return false;
+#endif
+
+    // NOTE: legacy barriers share one stage mask per call, so the batch gets the union of all stages
+    VkImageMemoryBarrier barriers[MAX_PENDING_BARRIERS];
+    VkPipelineStageFlags srcStages = 0;
+    VkPipelineStageFlags dstStages = 0;
+    for (uint32_t i = 0; i < cbr->pendingBarrierCount; ++i) {
+        ImageBarrier* pending = &cbr->pendingBarriers[i];
+        barriers[i] = (VkImageMemoryBarrier){
+            .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
+            .srcAccessMask = (VkAccessFlags)pending->src.access,
+            .dstAccessMask = (VkAccessFlags)pending->dst.access,
+            .oldLayout = pending->src.layout,
+            .newLayout = pending->dst.layout,
+            .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+            .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+            .image = pending->image,
+            .subresourceRange = {
+                .aspectMask = pending->aspect,
+                .baseMipLevel = 0,
+                .levelCount = 1,
+                .baseArrayLayer = 0,
+                .layerCount = 1}};
+        srcStages |= (VkPipelineStageFlags)pending->src.stage;
+        dstStages |= (VkPipelineStageFlags)pending->dst.stage;
+    }
+
+    vkCmdPipelineBarrier(
+        cbr->buf,
+        srcStages ? srcStages : VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+        dstStages ? dstStages : VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+        0, 0, 0, 0, 0,
+        cbr->pendingBarrierCount, barriers);
+    cbr->pendingBarrierCount = 0;
 }
 
-static void vulkan_depthbuffer_transition(VkCommandBuffer cbr, DepthBuffer* buf, VkImageLayout taget) {
-    if (buf->vkLayout == taget) {
+// NOTE: queues a barrier only when the tracked state actually conflicts with the requested one,
+//       read after read in the same layout just widens the tracked stages/access
+static void vulkan_image_require(VulkanState* vulkan, CmdBuffer* cbr, VkImage image, VkImageAspectFlags aspect, ImageState* state, ImageState target) {
+    bool hazard = (state->access & ACCESS_WRITE_MASK) || ((target.access & ACCESS_WRITE_MASK) && state->stage);
+    if (state->layout == target.layout && !hazard) {
+        state->stage |= target.stage;
+        state->access |= target.access;
         return;
     }
-    VkImageMemoryBarrier barrier = {
-        .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
-        .srcAccessMask = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT,
-        .dstAccessMask = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT,
-        .oldLayout = buf->vkLayout,
-        .newLayout = taget,
-        .image = buf->depthImage,
-        .subresourceRange = {
-            .aspectMask = VK_IMAGE_ASPECT_DEPTH_BIT,
-            .baseMipLevel = 0,
-            .levelCount = 1,
-            .baseArrayLayer = 0,
-            .layerCount = 1}};
 
-    vkCmdPipelineBarrier(cbr, VK_PIPELINE_STAGE_ALL_GRAPHICS_BIT, VK_PIPELINE_STAGE_ALL_GRAPHICS_BIT, 0, 0, 0, 0, 0, 1, &barrier);
-    buf->vkLayout = taget;
+    if (cbr->pendingBarrierCount == MAX_PENDING_BARRIERS) {
+        vulkan_barriers_flush(vulkan, cbr);
+    }
+    cbr->pendingBarriers[cbr->pendingBarrierCount++] = (ImageBarrier){
+        .image = image,
+        .aspect = aspect,
+        .src = *state,
+        .dst = target};
+    *state = target;
 }
 
 static bool vulkan_create_render_target(VulkanState* vulkan, uint32_t view, uint32_t image) {
-    VkImageView attachments[2];
+    VkImageView attachments[4];
     uint32_t attachmantCount = 0;
+    VkImageView resolveView = VK_NULL_HANDLE;
     if (vulkan->swapchainImageContext[view].swapchainImages[image].image != VK_NULL_HANDLE) {
         VkImageViewCreateInfo viewCI = {
             .sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO,
@@ -2048,9 +5013,14 @@ static bool vulkan_create_render_target(VulkanState* vulkan, uint32_t view, uint
             .subresourceRange.levelCount = 1,
             .subresourceRange.baseArrayLayer = 0,
             .subresourceRange.layerCount = 1};
-        VkResult result = vkCreateImageView(vulkan->device, &viewCI, 0, &vulkan->swapchainImageContext[view].renderTarget[image].colorView);
+        VkResult result = vkCreateImageView(vulkan->device, &viewCI, vulkan->allocator, &vulkan->swapchainImageContext[view].renderTarget[image].colorView);
         CHECKVK(result, "Failed to create Image view %u:%u", view, image);
-        attachments[attachmantCount++] = vulkan->swapchainImageContext[view].renderTarget[image].colorView;
+        if (vulkan->swapchainImageContext[view].msaaColor.colorView) {
+            attachments[attachmantCount++] = vulkan->swapchainImageContext[view].msaaColor.colorView;
+            resolveView = vulkan->swapchainImageContext[view].renderTarget[image].colorView;
+        } else {
+            attachments[attachmantCount++] = vulkan->swapchainImageContext[view].renderTarget[image].colorView;
+        }
     }
 
     if (vulkan->swapchainImageContext[view].depthBuffer.depthImage != VK_NULL_HANDLE) {
@@ -2069,105 +5039,538 @@ static bool vulkan_create_render_target(VulkanState* vulkan, uint32_t view, uint
             .subresourceRange.baseArrayLayer = 0,
             .subresourceRange.layerCount = 1,
         };
-        VkResult result = vkCreateImageView(vulkan->device, &viewCI, 0, &vulkan->swapchainImageContext[view].renderTarget[image].depthView);
+        VkResult result = vkCreateImageView(vulkan->device, &viewCI, vulkan->allocator, &vulkan->swapchainImageContext[view].renderTarget[image].depthView);
         CHECKVK(result, "Failed to create depth view %u:%u", view, image);
         attachments[attachmantCount++] = vulkan->swapchainImageContext[view].renderTarget[image].depthView;
     }
 
-    VkFramebufferCreateInfo fbCI = {
-        .sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO,
-        .attachmentCount = attachmantCount,
-        .pAttachments = attachments,
-        .renderPass = vulkan->swapchainImageContext[view].rp.pass,
-        .width = vulkan->swapchainImageContext[view].size.width,
-        .height = vulkan->swapchainImageContext[view].size.height,
-        .layers = 1};
-    VkResult result = vkCreateFramebuffer(vulkan->device, &fbCI, 0, &vulkan->swapchainImageContext[view].renderTarget[image].fb);
-    CHECKVK(result, "Failed to create frame buffer %u:%u", view, image);
+    if (resolveView) {
+        attachments[attachmantCount++] = resolveView;
+    }
+
+    if (vulkan->swapchainImageContext[view].shadingMap.view) {
+        attachments[attachmantCount++] = vulkan->swapchainImageContext[view].shadingMap.view;
+    } else if (vulkan->swapchainImageContext[view].rp.densityMap) {
+        VkImage densityImage = vulkan->swapchainImageContext[view].foveationImages[image].image;
+        if (!densityImage) {
+            CERROR("No fragment density map for image %u:%u", view, image);
+            return false;
+        }
+        VkImageViewCreateInfo viewCI = {
+            .sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO,
+            .image = densityImage,
+            .viewType = VK_IMAGE_VIEW_TYPE_2D,
+            .format = FOVEATION_DENSITY_FORMAT,
+            .subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+            .subresourceRange.baseMipLevel = 0,
+            .subresourceRange.levelCount = 1,
+            .subresourceRange.baseArrayLayer = 0,
+            .subresourceRange.layerCount = 1};
+        VkResult result = vkCreateImageView(vulkan->device, &viewCI, vulkan->allocator, &vulkan->swapchainImageContext[view].renderTarget[image].densityView);
+        CHECKVK(result, "Failed to create density map view %u:%u", view, image);
+        attachments[attachmantCount++] = vulkan->swapchainImageContext[view].renderTarget[image].densityView;
+    }
+
+    if (!vulkan->swapchainImageContext[view].rp.pass) {
+        return true;
+    }
+
+    VkFramebufferCreateInfo fbCI = {
+        .sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO,
+        .attachmentCount = attachmantCount,
+        .pAttachments = attachments,
+        .renderPass = vulkan->swapchainImageContext[view].rp.pass,
+        .width = vulkan->swapchainImageContext[view].size.width,
+        .height = vulkan->swapchainImageContext[view].size.height,
+        .layers = 1};
+    VkResult result = vkCreateFramebuffer(vulkan->device, &fbCI, vulkan->allocator, &vulkan->swapchainImageContext[view].renderTarget[image].fb);
+    CHECKVK(result, "Failed to create frame buffer %u:%u", view, image);
+    return true;
+}
+
+// NOTE: moves to the next region, waiting only if the GPU still reads it from FRAMES_IN_FLIGHT frames ago
+static bool vulkan_frame_ring_begin(VulkanState* vulkan, FrameRing* ring) {
+    ring->region = (ring->region + 1) % FRAMES_IN_FLIGHT;
+    ring->head = 0;
+    if (!vulkan_frame_sync_wait(vulkan, ring->regionFrame[ring->region], GPU_WAIT_TIMEOUT_NS)) {
+        CERROR("Timed out waiting for frame ring region %u", ring->region);
+        return false;
+    }
+    return true;
+}
+
+static bool vulkan_update_frame_data(VulkanState* vulkan, XrCompositionLayerProjectionView* views, uint32_t viewCount, Cube* cubes, uint32_t cubeCount) {
+    FrameData* frame = &vulkan->frame;
+    if (!vulkan_frame_ring_begin(vulkan, &frame->ring)) {
+        return false;
+    }
+
+    for (uint32_t i = 0; i < viewCount && i < NUM_VIEWES; ++i) {
+        RingAllocation alloc;
+        if (!vulkan_frame_ring_alloc(&frame->ring, sizeof(CameraData), &alloc)) {
+            return false;
+        }
+        CameraData* camera = alloc.data;
+        if (vulkan->depth.reverseZ) {
+            mat_create_proj_reverse_z(&camera->proj, views[i].fov, vulkan->depth.nearZ, vulkan->depth.farZ);
+        } else {
+            mat_create_proj(&camera->proj, views[i].fov, vulkan->depth.nearZ, vulkan->depth.farZ);
+        }
+        XrMatrix4x4f toView;
+        XrVector3f scale = {1.f, 1.f, 1.f};
+        mat_create_translation_rotation_scale(&toView, &views[i].pose.position, &views[i].pose.orientation, &scale);
+        mat_invert(&camera->view, &toView);
+        frame->cameraOffset[i] = alloc.offset;
+
+        // NOTE: the mesh is copied every frame since the ring regions take turns
+        VisibilityMask* mask = &vulkan->visibilityMask[i];
+        frame->maskIndexCount[i] = 0;
+        if (mask->indexCount) {
+            RingAllocation maskCamera, vertices, indices;
+            if (!vulkan_frame_ring_alloc(&frame->ring, sizeof(CameraData), &maskCamera) ||
+                !vulkan_frame_ring_alloc(&frame->ring, sizeof(Vertex) * mask->vertexCount, &vertices) ||
+                !vulkan_frame_ring_alloc(&frame->ring, sizeof(uint32_t) * mask->indexCount, &indices)) {
+                return false;
+            }
+            CameraData* view = maskCamera.data;
+            view->proj = camera->proj;
+            mat_create_scale(&view->view, 1.0f, 1.0f, 1.0f);
+
+            float distance = vulkan->depth.nearZ * VISIBILITY_MASK_DEPTH;
+            Vertex* vertex = vertices.data;
+            for (uint32_t v = 0; v < mask->vertexCount; ++v) {
+                vertex[v] = (Vertex){
+                    .pos = {mask->vertices[v].x * distance, mask->vertices[v].y * distance, -distance},
+                    .color = {0.0f, 0.0f, 0.0f}};
+            }
+            memcpy(indices.data, mask->indices, sizeof(uint32_t) * mask->indexCount);
+
+            frame->maskCameraOffset[i] = maskCamera.offset;
+            frame->maskVertexOffset[i] = vertices.offset;
+            frame->maskIndexOffset[i] = indices.offset;
+            frame->maskIndexCount[i] = mask->indexCount;
+        }
+
+        // NOTE: asymmetric fields of view put the point straight ahead off the image center
+        ShadingMap* map = &vulkan->swapchainImageContext[i].shadingMap;
+        if (map->image) {
+            float tanLeft = tanf(views[i].fov.angleLeft);
+            float tanRight = tanf(views[i].fov.angleRight);
+            float tanUp = tanf(views[i].fov.angleUp);
+            float tanDown = tanf(views[i].fov.angleDown);
+            map->center[0] = tanLeft / (tanLeft - tanRight);
+            map->center[1] = tanUp / (tanUp - tanDown);
+        }
+    }
+
+    if (cubeCount > MAX_OBJECTS) {
+        CWARN("Too many objects %u, drawing the first %u", cubeCount, MAX_OBJECTS);
+        cubeCount = MAX_OBJECTS;
+    }
+
+    // NOTE: the binding range is MAX_OBJECTS long, so the allocation has to be as well
+    RingAllocation alloc;
+    if (!vulkan_frame_ring_alloc(&frame->ring, sizeof(ObjectData) * MAX_OBJECTS, &alloc)) {
+        return false;
+    }
+    ObjectData* objects = alloc.data;
+    for (uint32_t i = 0; i < cubeCount; ++i) {
+        mat_create_translation_rotation_scale(&objects[i].model, &cubes[i].pose.position, &cubes[i].pose.orientation, &cubes[i].scale);
+        objects[i].color = (XrColor4f){1.0f, 1.0f, 1.0f, 1.0f};
+    }
+    frame->objectOffset = alloc.offset;
+    frame->objectCount = cubeCount;
+
+    return vulkan_frame_ring_flush(vulkan, &frame->ring);
+}
+
+// NOTE: full rate inside the level's inner radius around the projection center, then a linear falloff to the level's
+//       border density. Radii are in halves of the rendered sub-rect, texels outside of it get the border density.
+static void vulkan_shading_map_fill(ShadingMap* map, uint32_t level, VkExtent2D renderSize) {
+    const float* falloff = FOVEATION_FALLOFF[level < array_size(FOVEATION_FALLOFF) ? level : array_size(FOVEATION_FALLOFF) - 1];
+    uint32_t texelSize = vulkan_format_size(map->format);
+    for (uint32_t y = 0; y < map->extent.height; ++y) {
+        for (uint32_t x = 0; x < map->extent.width; ++x) {
+            float u = ((x + 0.5f) * map->texel.width / renderSize.width - map->center[0]) * 2.0f;
+            float v = ((y + 0.5f) * map->texel.height / renderSize.height - map->center[1]) * 2.0f;
+            float t = (sqrtf(u * u + v * v) - falloff[0]) / (1.0f - falloff[0]);
+            t = t < 0.0f ? 0.0f : (t > 1.0f ? 1.0f : t);
+            float density = 1.0f - t * (1.0f - falloff[1]);
+
+            uint8_t* texel = map->mapped + (y * map->extent.width + x) * texelSize;
+            if (map->format == SHADING_RATE_FORMAT) {
+                // NOTE: log2 of the fragment width in bits 2-3 and of the height in bits 0-1, the device clamps to its rates
+                uint8_t rate = density > 0.75f ? 0 : (density > 0.375f ? 1 : 2);
+                texel[0] = (uint8_t)((rate << 2) | rate);
+            } else {
+                texel[0] = texel[1] = (uint8_t)(density * 255.0f + 0.5f);
+            }
+        }
+    }
+}
+
+// NOTE: the view's previous command buffer has finished by the time it is recorded again, so the staging buffer is free
+static bool vulkan_shading_map_update(VulkanState* vulkan, CmdBuffer* cbr, ShadingMap* map, VkExtent2D renderSize) {
+    bool stale = map->generatedLevel != vulkan->foveationLevel ||
+                 map->generatedSize.width != renderSize.width ||
+                 map->generatedSize.height != renderSize.height ||
+                 fabsf(map->generatedCenter[0] - map->center[0]) > 0.01f ||
+                 fabsf(map->generatedCenter[1] - map->center[1]) > 0.01f;
+    if (stale) {
+        vulkan_shading_map_fill(map, vulkan->foveationLevel, renderSize);
+        if (!map->coherent) {
+            VkMappedMemoryRange range = {
+                .sType = VK_STRUCTURE_TYPE_MAPPED_MEMORY_RANGE,
+                .memory = map->stagingMemory,
+                .offset = 0,
+                .size = VK_WHOLE_SIZE};
+            VkResult result = vkFlushMappedMemoryRanges(vulkan->device, 1, &range);
+            CHECKVK(result, "Failed to flush foveation map staging memory");
+        }
+
+        vulkan_image_require(vulkan, cbr, map->image, VK_IMAGE_ASPECT_COLOR_BIT, &map->state, IMAGE_STATE_TRANSFER_DST);
+        vulkan_barriers_flush(vulkan, cbr);
+        VkBufferImageCopy region = {
+            .bufferOffset = 0,
+            .imageSubresource = {
+                .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+                .mipLevel = 0,
+                .baseArrayLayer = 0,
+                .layerCount = 1},
+            .imageExtent = {.width = map->extent.width, .height = map->extent.height, .depth = 1}};
+        vkCmdCopyBufferToImage(cbr->buf, map->staging, map->image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &region);
+
+        map->generatedLevel = vulkan->foveationLevel;
+        map->generatedSize = renderSize;
+        map->generatedCenter[0] = map->center[0];
+        map->generatedCenter[1] = map->center[1];
+    }
+
+    vulkan_image_require(vulkan, cbr, map->image, VK_IMAGE_ASPECT_COLOR_BIT, &map->state, map->read);
     return true;
 }
 
-static bool vulkan_render_view(VulkanState* vulkan, XrCompositionLayerProjectionView view, uint32_t swapchainIndex, uint32_t image, Cube* cubes, uint32_t cubeCount) {
+static bool vulkan_record_view(VulkanState* vulkan, uint32_t swapchainIndex, uint32_t image) {
     SwapchainImageContext* context = &vulkan->swapchainImageContext[swapchainIndex];
+    CmdBuffer* cbr = &vulkan->cmdBuffer[swapchainIndex];
 
-    if (!vulkan_commandbuffer_reset(vulkan)) {
+    if (!vulkan_commandbuffer_reset(vulkan, cbr)) {
         CERROR("Faield to reset command buffer");
         return false;
     }
 
-    if (!vulkan_commandbuffer_begin(vulkan)) {
+    if (!vulkan_commandbuffer_begin(vulkan, cbr)) {
         CERROR("Faield to begin command buffer");
         return false;
     }
 
-    vulkan_depthbuffer_transition(vulkan->cmdBuffer.buf, &context->depthBuffer, VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL);
+    vulkan_gpu_timer_begin(vulkan, cbr->buf, swapchainIndex);
+    if (swapchainIndex == 0) {
+        vulkan_upload_acquire(vulkan, cbr->buf);
+    }
 
     VkClearValue clearValues[] = {
         {.color = {0.184313729f, 0.309803933f, 0.309803933f, 1.0f}},
-        {.depthStencil = {.depth = 1.0f, .stencil = 0}}};
+        {.depthStencil = {.depth = vulkan->depth.reverseZ ? 0.0f : 1.0f, .stencil = 0}}};
 
-    if (!context->renderTarget[image].fb) {
+    if (!context->renderTarget[image].colorView) {
         if (!vulkan_create_render_target(vulkan, swapchainIndex, image)) {
             CERROR("Fauled to create render target %u:%u", swapchainIndex, image);
             return false;
         }
     }
 
-    VkRenderPassBeginInfo rpBI = {
-        .sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO,
-        .clearValueCount = array_size(clearValues),
-        .pClearValues = clearValues,
-        .renderPass = context->rp.pass,
-        .framebuffer = context->renderTarget[image].fb,
-        .renderArea = {
-            .offset = {0, 0},
-            .extent = context->size}};
-
-    vkCmdBeginRenderPass(vulkan->cmdBuffer.buf, &rpBI, VK_SUBPASS_CONTENTS_INLINE);
-    vkCmdBindPipeline(vulkan->cmdBuffer.buf, VK_PIPELINE_BIND_POINT_GRAPHICS, context->pipe);
-    vkCmdBindIndexBuffer(vulkan->cmdBuffer.buf, vulkan->drawBuffer.idxBuf, 0, VK_INDEX_TYPE_UINT16);
-    VkDeviceSize offset = 0;
-    vkCmdBindVertexBuffers(vulkan->cmdBuffer.buf, 0, 1, &vulkan->drawBuffer.vtxBuf, &offset);
+    // NOTE: both attachments are cleared, so depth transitions from UNDEFINED and nothing is read back
+    context->renderTarget[image].colorState = IMAGE_STATE_ACQUIRED;
+    context->depthBuffer.state.layout = VK_IMAGE_LAYOUT_UNDEFINED;
+    if (context->msaaColor.colorImage) {
+        context->msaaColor.state.layout = VK_IMAGE_LAYOUT_UNDEFINED;
+        vulkan_image_require(
+            vulkan, cbr,
+            context->msaaColor.colorImage, VK_IMAGE_ASPECT_COLOR_BIT,
+            &context->msaaColor.state, IMAGE_STATE_COLOR_ATTACHMENT);
+    }
+    vulkan_image_require(
+        vulkan, cbr,
+        context->swapchainImages[image].image, VK_IMAGE_ASPECT_COLOR_BIT,
+        &context->renderTarget[image].colorState, IMAGE_STATE_COLOR_ATTACHMENT);
+    vulkan_image_require(
+        vulkan, cbr,
+        context->depthBuffer.depthImage, VK_IMAGE_ASPECT_DEPTH_BIT,
+        &context->depthBuffer.state, IMAGE_STATE_DEPTH_ATTACHMENT);
+    if (context->shadingMap.image && !vulkan_shading_map_update(vulkan, cbr, &context->shadingMap, context->renderSize)) {
+        CERROR("Failed to update foveation map %u", swapchainIndex);
+        return false;
+    }
+    vulkan_barriers_flush(vulkan, cbr);
+
+    VkRect2D renderArea = {
+        .offset = {0, 0},
+        .extent = context->renderSize};
+
+#if defined(VK_KHR_dynamic_rendering)
+    if (vulkan->caps.dynamicRendering) {
+        VkRenderingAttachmentInfoKHR colorAttachment = {
+            .sType = VK_STRUCTURE_TYPE_RENDERING_ATTACHMENT_INFO_KHR,
+            .imageView = context->renderTarget[image].colorView,
+            .imageLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
+            .loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR,
+            .storeOp = VK_ATTACHMENT_STORE_OP_STORE,
+            .clearValue = clearValues[0]};
+        if (context->msaaColor.colorView) {
+            colorAttachment.imageView = context->msaaColor.colorView;
+            colorAttachment.storeOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+            colorAttachment.resolveMode = VK_RESOLVE_MODE_AVERAGE_BIT_KHR;
+            colorAttachment.resolveImageView = context->renderTarget[image].colorView;
+            colorAttachment.resolveImageLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+        }
+        VkRenderingAttachmentInfoKHR depthAttachment = {
+            .sType = VK_STRUCTURE_TYPE_RENDERING_ATTACHMENT_INFO_KHR,
+            .imageView = context->renderTarget[image].depthView,
+            .imageLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL,
+            .loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR,
+            .storeOp = context->submitDepth ? VK_ATTACHMENT_STORE_OP_STORE : VK_ATTACHMENT_STORE_OP_DONT_CARE,
+            .clearValue = clearValues[1]};
+        VkRenderingInfoKHR renderingInfo = {
+            .sType = VK_STRUCTURE_TYPE_RENDERING_INFO_KHR,
+            .renderArea = renderArea,
+            .layerCount = 1,
+            .colorAttachmentCount = 1,
+            .pColorAttachments = &colorAttachment,
+            .pDepthAttachment = context->renderTarget[image].depthView ? &depthAttachment : 0};
+        vulkan->cmdBeginRendering(cbr->buf, &renderingInfo);
+    } else
+#endif
+    {
+        VkRenderPassBeginInfo rpBI = {
+            .sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO,
+            .clearValueCount = array_size(clearValues),
+            .pClearValues = clearValues,
+            .renderPass = context->rp.pass,
+            .framebuffer = context->renderTarget[image].fb,
+            .renderArea = renderArea};
+        vkCmdBeginRenderPass(cbr->buf, &rpBI, VK_SUBPASS_CONTENTS_INLINE);
+    }
 
-    XrPosef pose = view.pose;
-    XrMatrix4x4f proj;
-    mat_create_proj(&proj, view.fov, 0.05f, 100.0f);
-    XrMatrix4x4f toView;
-    XrVector3f scale = {1.f, 1.f, 1.f};
-    mat_create_translation_rotation_scale(&toView, &pose.position, &pose.orientation, &scale);
-    XrMatrix4x4f viewMAt;
-    mat_invert(&viewMAt, &toView);
-    XrMatrix4x4f vp;
-    mat_mul(&vp, &proj, &viewMAt);
+    VkViewport viewport = {
+        .x = 0.0f,
+        .y = 0.0f,
+        .width = (float)context->renderSize.width,
+        .height = (float)context->renderSize.height,
+        .minDepth = 0.0f,
+        .maxDepth = 1.0f};
+
+    // NOTE: the hidden area goes first at near plane depth, the depth test then rejects everything behind it
+    VkPipeline maskPipe = context->maskPipeline ? vulkan_pipeline_ready(context->maskPipeline) : VK_NULL_HANDLE;
+    if (maskPipe && vulkan->frame.maskIndexCount[swapchainIndex]) {
+        vkCmdBindPipeline(cbr->buf, VK_PIPELINE_BIND_POINT_GRAPHICS, maskPipe);
+        vkCmdSetViewport(cbr->buf, 0, 1, &viewport);
+        vkCmdSetScissor(cbr->buf, 0, 1, &renderArea);
+        vkCmdBindIndexBuffer(cbr->buf, vulkan->frame.ring.buf, vulkan->frame.maskIndexOffset[swapchainIndex], VK_INDEX_TYPE_UINT32);
+        VkDeviceSize offset = vulkan->frame.maskVertexOffset[swapchainIndex];
+        vkCmdBindVertexBuffers(cbr->buf, 0, 1, &vulkan->frame.ring.buf, &offset);
+
+        uint32_t dynamicOffsets[] = {vulkan->frame.maskCameraOffset[swapchainIndex], vulkan->frame.objectOffset};
+        vkCmdBindDescriptorSets(cbr->buf, VK_PIPELINE_BIND_POINT_GRAPHICS, vulkan->pipelineLayout, 0, 1, &vulkan->frame.set, array_size(dynamicOffsets), dynamicOffsets);
+        vkCmdDrawIndexed(cbr->buf, vulkan->frame.maskIndexCount[swapchainIndex], 1, 0, 0, 0);
+    }
 
-    for (uint32_t i = 0; i < cubeCount; ++i) {
-        XrMatrix4x4f model;
-        mat_create_translation_rotation_scale(&model, &cubes[i].pose.position, &cubes[i].pose.orientation, &cubes[i].scale);
-        XrMatrix4x4f mvp;
-        mat_mul(&mvp, &vp, &model);
-        vkCmdPushConstants(vulkan->cmdBuffer.buf, vulkan->pipelineLayout, VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(mvp.m), &mvp.m[0]);
-        vkCmdDrawIndexed(vulkan->cmdBuffer.buf, vulkan->drawBuffer.idxCount, 1, 0, 0, 0);
+    // NOTE: a pipeline still compiling leaves the view cleared for this frame instead of stalling it
+    VkPipeline pipe = vulkan_pipeline_ready(context->pipeline);
+    bool geometryReady = vulkan_upload_ready(vulkan->drawBuffer.idxUpload) && vulkan_upload_ready(vulkan->drawBuffer.vtxUpload);
+    if (!pipe) {
+        ++vulkan->pipelines.skipped;
+    } else if (vulkan->frame.objectCount && geometryReady) {
+        vkCmdBindPipeline(cbr->buf, VK_PIPELINE_BIND_POINT_GRAPHICS, pipe);
+        vkCmdSetViewport(cbr->buf, 0, 1, &viewport);
+        vkCmdSetScissor(cbr->buf, 0, 1, &renderArea);
+        vkCmdBindIndexBuffer(cbr->buf, vulkan->drawBuffer.idxBuf, 0, VK_INDEX_TYPE_UINT16);
+        VkDeviceSize offset = 0;
+        vkCmdBindVertexBuffers(cbr->buf, 0, 1, &vulkan->drawBuffer.vtxBuf, &offset);
+
+        uint32_t dynamicOffsets[] = {vulkan->frame.cameraOffset[swapchainIndex], vulkan->frame.objectOffset};
+        vkCmdBindDescriptorSets(cbr->buf, VK_PIPELINE_BIND_POINT_GRAPHICS, vulkan->pipelineLayout, 0, 1, &vulkan->frame.set, array_size(dynamicOffsets), dynamicOffsets);
+        vkCmdDrawIndexed(cbr->buf, vulkan->drawBuffer.idxCount, vulkan->frame.objectCount, 0, 0, 0);
     }
 
-    vkCmdEndRenderPass(vulkan->cmdBuffer.buf);
+#if defined(VK_KHR_dynamic_rendering)
+    if (vulkan->caps.dynamicRendering) {
+        vulkan->cmdEndRendering(cbr->buf);
+    } else
+#endif
+    {
+        vkCmdEndRenderPass(cbr->buf);
+    }
 
-    if (!vulkan_commandbuffer_end(vulkan)) {
+    vulkan_gpu_timer_end(vulkan, cbr->buf, swapchainIndex);
+    if (!vulkan_commandbuffer_end(vulkan, cbr)) {
         CERROR("Faield to end command buffer");
         return false;
     }
+    return true;
+}
 
-    if (!vulkan_commandbuffer_exec(vulkan)) {
-        CERROR("Faield to exec command buffer");
-        return false;
+// NOTE: a mesh that doesn't fit or fails to load leaves the view unmasked
+static bool program_update_visibility_mask(OpenXrProgram* program, VulkanState* vulkan, uint32_t view) {
+    VisibilityMask* mask = &vulkan->visibilityMask[view];
+    mask->vertexCount = 0;
+    mask->indexCount = 0;
+
+    XrVisibilityMaskKHR visibilityMask = {
+        .type = XR_TYPE_VISIBILITY_MASK_KHR};
+    XrResult result = program->getVisibilityMask(program->session, program->viewConfigType, view, XR_VISIBILITY_MASK_TYPE_HIDDEN_TRIANGLE_MESH_KHR, &visibilityMask);
+    CHECKXR(result, "Failed to get visibility mask size %u", view);
+
+    if (visibilityMask.vertexCountOutput > MAX_MASK_VERTICES || visibilityMask.indexCountOutput > MAX_MASK_INDICES) {
+        CWARN("Visibility mask %u too large: %u vertices, %u indices", view, visibilityMask.vertexCountOutput, visibilityMask.indexCountOutput);
+        return true;
     }
 
-    if (!vulkan_commandbuffer_wait(vulkan)) {
-        CERROR("Faield to wait for command buffer");
-        return false;
+    visibilityMask.vertexCapacityInput = visibilityMask.vertexCountOutput;
+    visibilityMask.vertices = mask->vertices;
+    visibilityMask.indexCapacityInput = visibilityMask.indexCountOutput;
+    visibilityMask.indices = mask->indices;
+    result = program->getVisibilityMask(program->session, program->viewConfigType, view, XR_VISIBILITY_MASK_TYPE_HIDDEN_TRIANGLE_MESH_KHR, &visibilityMask);
+    CHECKXR(result, "Failed to get visibility mask %u", view);
+
+    mask->vertexCount = visibilityMask.vertexCountOutput;
+    mask->indexCount = visibilityMask.indexCountOutput - visibilityMask.indexCountOutput % 3;
+    CINFO("Visibility mask %u: %u hidden triangles", view, mask->indexCount / 3);
+    return true;
+}
+
+static bool program_wait_swapchain_image(OpenXrProgram* program, uint32_t view) {
+    XrSwapchainImageWaitInfo waitInfo = {
+        .type = XR_TYPE_SWAPCHAIN_IMAGE_WAIT_INFO,
+        .timeout = SWAPCHAIN_WAIT_TIMEOUT_NS};
+
+    SwapchainWaitStats* stats = &program->swapchainWaitStats;
+    uint64_t start = time_now_ns();
+    uint32_t attempts = 0;
+    XrResult result;
+    while ((result = xrWaitSwapchainImage(program->swapchains[view].handle, &waitInfo)) == XR_TIMEOUT_EXPIRED) {
+        ++stats->timeouts;
+        if (++attempts >= SWAPCHAIN_WAIT_MAX_ATTEMPTS) {
+            CERROR("Gave up waiting for image %u after %u timeouts", view, attempts);
+            return false;
+        }
+        CWARN("Wait for image %u timed out [%u]", view, attempts);
+    }
+    CHECKXR(result, "Failed to wait for image %u", view);
+
+    uint64_t waitNs = time_now_ns() - start;
+    stats->totalNs += waitNs;
+    stats->maxNs = waitNs > stats->maxNs ? waitNs : stats->maxNs;
+    if (++stats->waits % SWAPCHAIN_WAIT_REPORT_INTERVAL == 0) {
+        CDEBUG("Swapchain image wait: avg %.3f ms, max %.3f ms, timeouts %llu",
+               stats->totalNs / (double)SWAPCHAIN_WAIT_REPORT_INTERVAL / 1000000.0,
+               stats->maxNs / 1000000.0,
+               (unsigned long long)stats->timeouts);
+        stats->totalNs = 0;
+        stats->maxNs = 0;
     }
     return true;
 }
 
+// NOTE: hands back every image a failed frame still holds without rendering it, so the next acquire gets a fresh
+//       one. An image that can't be waited on can't be released either, that leaves the swapchain stuck.
+static bool program_drain_swapchain_images(OpenXrProgram* program) {
+    for (uint32_t i = 0; i < NUM_VIEWES; ++i) {
+        if (!(program->acquiredViews & (1u << i))) {
+            continue;
+        }
+        if (!program_wait_swapchain_image(program, i)) {
+            return false;
+        }
+
+        XrSwapchainImageReleaseInfo releaseInfo = {
+            .type = XR_TYPE_SWAPCHAIN_IMAGE_RELEASE_INFO};
+        XrResult result = xrReleaseSwapchainImage(program->swapchains[i].handle, &releaseInfo);
+        CHECKXR(result, "Failed to release drained image %u", i);
+        program->acquiredViews &= ~(1u << i);
+    }
+    return true;
+}
+
+static VkExtent2D program_render_size(OpenXrProgram* program, uint32_t view) {
+    uint32_t width = (uint32_t)(program->swapchains[view].width * program->resolution.scale + 0.5f);
+    uint32_t height = (uint32_t)(program->swapchains[view].height * program->resolution.scale + 0.5f);
+    width = width < 1 ? 1 : (width > (uint32_t)program->swapchains[view].width ? (uint32_t)program->swapchains[view].width : width);
+    height = height < 1 ? 1 : (height > (uint32_t)program->swapchains[view].height ? (uint32_t)program->swapchains[view].height : height);
+    return (VkExtent2D){width, height};
+}
+
+// NOTE: drops right away once the GPU runs past DYNRES_TARGET_PERCENT of the display period, by the square root
+//       of the overshoot since cost follows the pixel count, and only climbs back in small steps after a calm stretch.
+//       Between the two thresholds nothing moves, that gap is the hysteresis.
+static void program_update_resolution(OpenXrProgram* program, VulkanState* vulkan, XrDuration displayPeriod) {
+#if DYNAMIC_RESOLUTION
+    DynamicResolution* res = &program->resolution;
+    if (!res->gpuNs || displayPeriod <= 0) {
+        return;
+    }
+
+    float scale = res->scale;
+    double target = displayPeriod * DYNRES_TARGET_PERCENT / 100.0;
+    double raise = displayPeriod * DYNRES_RAISE_PERCENT / 100.0;
+    // NOTE: foveation is the deeper lever, it goes up only once the render scale bottomed out and comes back down first
+    Foveation* foveation = &program->foveation;
+    if (res->gpuNs > target) {
+        if (res->scale <= DYNRES_MIN_SCALE && foveation->enabled && foveation->level < XR_FOVEATION_LEVEL_HIGH_FB) {
+            program_apply_foveation(program, vulkan, foveation->level + 1);
+        }
+        scale *= sqrtf((float)(target / res->gpuNs));
+        res->calmFrames = 0;
+    } else if (res->gpuNs < raise && ++res->calmFrames >= DYNRES_RAISE_FRAMES) {
+        if (foveation->enabled && foveation->level > FOVEATION_LEVEL) {
+            program_apply_foveation(program, vulkan, foveation->level - 1);
+        } else {
+            scale += DYNRES_RAISE_STEP;
+        }
+        res->calmFrames = 0;
+    } else if (res->gpuNs >= raise) {
+        res->calmFrames = 0;
+    }
+
+    scale = scale < DYNRES_MIN_SCALE ? DYNRES_MIN_SCALE : (scale > res->maxScale ? res->maxScale : scale);
+    if (scale != res->scale) {
+        CDEBUG("Dynamic resolution %.2f -> %.2f (GPU %.3f ms, display period %.3f ms)",
+               res->scale, scale, res->gpuNs / 1000000.0, displayPeriod / 1000000.0);
+        res->scale = scale;
+    }
+    res->gpuNs = 0;
+#endif
+}
+
+#if defined(XR_META_recommended_layer_resolution)
+// NOTE: the runtime's suggestion for the layer as submitted, it caps how far the controller may climb
+static void program_query_layer_resolution(OpenXrProgram* program, const XrCompositionLayerProjection* layer, XrTime displayTime) {
+    if (!DYNAMIC_RESOLUTION || !program->caps.recommendedLayerResolution) {
+        return;
+    }
+
+    XrRecommendedLayerResolutionGetInfoMETA info = {
+        .type = XR_TYPE_RECOMMENDED_LAYER_RESOLUTION_GET_INFO_META,
+        .layer = (const XrCompositionLayerBaseHeader*)layer,
+        .predictedDisplayTime = displayTime};
+    XrRecommendedLayerResolutionMETA recommended = {
+        .type = XR_TYPE_RECOMMENDED_LAYER_RESOLUTION_META};
+    XrResult result = program->getRecommendedLayerResolution(program->session, &info, &recommended);
+
+    float maxScale = 1.0f;
+    if (XR_SUCCEEDED(result) && recommended.isValid) {
+        float scaleX = recommended.recommendedImageDimensions.width / (float)program->swapchains[0].width;
+        float scaleY = recommended.recommendedImageDimensions.height / (float)program->swapchains[0].height;
+        maxScale = scaleX < scaleY ? scaleX : scaleY;
+        maxScale = maxScale < DYNRES_MIN_SCALE ? DYNRES_MIN_SCALE : (maxScale > 1.0f ? 1.0f : maxScale);
+    }
+    if (maxScale != program->resolution.maxScale) {
+        CDEBUG("Runtime recommends a render scale of at most %.2f", maxScale);
+        program->resolution.maxScale = maxScale;
+    }
+}
+#endif
+
 static bool program_render_layer(
     OpenXrProgram* program,
     VulkanState* vulkan,
@@ -2205,7 +5608,7 @@ static bool program_render_layer(
         return false;
     }
 
-    uint32_t cubeCount;
+    uint32_t cubeCount = 0;
     Cube cubes[array_size(VISULAIZED_SPACES) + SIDE_COUNT];
 
     for (uint32_t i = 0; i < array_size(VISULAIZED_SPACES); ++i) {
@@ -2245,20 +5648,19 @@ static bool program_render_layer(
         }
     }
 
+    // NOTE: acquire every view up front, only the submission has to wait for the compositor
+    uint32_t images[NUM_VIEWES];
     for (uint32_t i = 0; i < viewCount; ++i) {
         XrSwapchainImageAcquireInfo acquireInfo = {
             .type = XR_TYPE_SWAPCHAIN_IMAGE_ACQUIRE_INFO};
 
-        uint32_t image;
-        result = xrAcquireSwapchainImage(program->swapchains[i].handle, &acquireInfo, &image);
+        result = xrAcquireSwapchainImage(program->swapchains[i].handle, &acquireInfo, &images[i]);
         CHECKXR(result, "Faield to acquire next image %u", i);
+        program->acquiredViews |= 1u << i;
 
-        XrSwapchainImageWaitInfo waitInfo = {
-            .type = XR_TYPE_SWAPCHAIN_IMAGE_WAIT_INFO,
-            .timeout = XR_INFINITE_DURATION};
-        result = xrWaitSwapchainImage(program->swapchains[i].handle, &waitInfo);
-        CHECKXR(result, "Failed to wait for image %u", i);
-
+        // NOTE: same field of view, the compositor stretches the sub-rect over it
+        VkExtent2D renderSize = program_render_size(program, i);
+        vulkan->swapchainImageContext[i].renderSize = renderSize;
         views[i] = (XrCompositionLayerProjectionView){
             .type = XR_TYPE_COMPOSITION_LAYER_PROJECTION_VIEW,
             .pose = program->views[i].pose,
@@ -2267,18 +5669,61 @@ static bool program_render_layer(
                 .swapchain = program->swapchains[i].handle,
                 .imageRect = (XrRect2Di){
                     {0, 0},
-                    {program->swapchains[i].width, program->swapchains[i].height}}}};
+                    {(int32_t)renderSize.width, (int32_t)renderSize.height}}}};
+    }
+
+    for (uint32_t i = 0; i < viewCount; ++i) {
+        if (program->visibilityMaskStale & (1u << i)) {
+            program->visibilityMaskStale &= ~(1u << i);
+            if (!program_update_visibility_mask(program, vulkan, i)) {
+                CWARN("View %u is drawn without its visibility mask", i);
+            }
+        }
+    }
 
-        if (!vulkan_render_view(vulkan, views[i], i, image, cubes, cubeCount)) {
-            CERROR("Faield to render view %u", i);
+    if (!vulkan_update_frame_data(vulkan, views, viewCount, cubes, cubeCount)) {
+        CERROR("Faield to update frame data");
+        return false;
+    }
+
+    for (uint32_t i = 0; i < viewCount; ++i) {
+        if (!vulkan_record_view(vulkan, i, images[i])) {
+            CERROR("Faield to record view %u", i);
             return false;
         }
+    }
+
+    // NOTE: a view that fails to submit is still released, the views after it are left to the caller's drain
+    bool submitted = true;
+    for (uint32_t i = 0; i < viewCount && submitted; ++i) {
+        if (!program_wait_swapchain_image(program, i)) {
+            submitted = false;
+            break;
+        }
+
+        if (!vulkan_commandbuffer_exec(vulkan, &vulkan->cmdBuffer[i])) {
+            CERROR("Faield to exec command buffer %u", i);
+            submitted = false;
+        }
 
         XrSwapchainImageReleaseInfo releaseInfo = {
             .type = XR_TYPE_SWAPCHAIN_IMAGE_RELEASE_INFO};
         result = xrReleaseSwapchainImage(program->swapchains[i].handle, &releaseInfo);
         CHECKXR(result, "Faield to release image %u", i);
+        program->acquiredViews &= ~(1u << i);
+    }
+    vulkan_frame_ring_retire(vulkan, &vulkan->frame.ring);
+
+    for (uint32_t i = 0; i < viewCount; ++i) {
+        if (!vulkan_commandbuffer_wait(vulkan, &vulkan->cmdBuffer[i])) {
+            CERROR("Faield to wait for command buffer %u", i);
+            return false;
+        }
+    }
+    if (!submitted) {
+        return false;
     }
+    program->resolution.gpuNs = vulkan_gpu_timer_read(vulkan, viewCount);
 
     layer->type = XR_TYPE_COMPOSITION_LAYER_PROJECTION;
     layer->space = program->space;
@@ -2288,6 +5733,102 @@ static bool program_render_layer(
     return true;
 }
 
+// NOTE: new swapchains are created next to the old ones, the old swapchain and everything that referenced
+//       its images go through the deferred destroy queue, so frames still in flight keep valid handles
+static bool program_rebuild_swapchains(OpenXrProgram* program, VulkanState* vulkan) {
+    uint64_t start = time_now_ns();
+    for (uint32_t i = 0; i < NUM_VIEWES; ++i) {
+        XrExtent2Di size = program_swapchain_size(program, i);
+        if (!program->swapchains[i].handle || (size.width == program->swapchains[i].width && size.height == program->swapchains[i].height)) {
+            continue;
+        }
+
+        XrSwapchainCreateInfo swapchainCI = program_swapchain_ci(program, size);
+        XrSwapchain handle = XR_NULL_HANDLE;
+        XrResult result = xrCreateSwapchain(program->session, &swapchainCI, &handle);
+        uint32_t imageCount = 0;
+        if (XR_SUCCEEDED(result)) {
+            result = xrEnumerateSwapchainImages(handle, 0, &imageCount, 0);
+        }
+        if (!XR_SUCCEEDED(result) || imageCount > MAX_IMAGES) {
+            // NOTE: nothing was touched yet, keep rendering at the old size and try again on the next poll
+            CWARN("Failed to create %dx%d swapchain %u [%d], keeping %dx%d", size.width, size.height, i, result,
+                  program->swapchains[i].width, program->swapchains[i].height);
+            if (handle) {
+                xrDestroySwapchain(handle);
+            }
+            continue;
+        }
+
+        // NOTE: past this point the old swapchain is gone, a failure leaves the view without render targets
+        SwapchainImageContext* context = &vulkan->swapchainImageContext[i];
+        VkDeviceSize released = 0;
+        uint32_t objects = 0;
+        if (!vulkan_retire_view_targets(vulkan, context, &released, &objects) ||
+            !vulkan_defer_destroy(vulkan, DESTROY_Swapchain, (DestroyHandle){.swapchain = program->swapchains[i].handle})) {
+            CERROR("Failed to retire swapchain %u", i);
+            xrDestroySwapchain(handle);
+            return false;
+        }
+        CINFO("View[%u] swapchain %dx%d -> %dx%d", i, program->swapchains[i].width, program->swapchains[i].height, size.width, size.height);
+        program->swapchains[i] = (Swapchain){
+            .handle = handle,
+            .width = size.width,
+            .height = size.height};
+
+        XrSwapchainImageBaseHeader* imagesBase = vulkan_resize_swapchain_images(vulkan, &swapchainCI, imageCount, i);
+        if (!imagesBase) {
+            return false;
+        }
+        result = xrEnumerateSwapchainImages(handle, imageCount, &imageCount, imagesBase);
+        CHECKXR(result, "Failed to get swapchain %u's images", i);
+
+        // NOTE: build the render targets now rather than in the middle of the next frames
+        for (uint32_t image = 0; image < imageCount; ++image) {
+            if (!vulkan_create_render_target(vulkan, i, image)) {
+                CERROR("Failed to create render target %u:%u", i, image);
+                return false;
+            }
+        }
+    }
+
+    if (!program_apply_foveation(program, vulkan, program->foveation.level)) {
+        return false;
+    }
+
+    CINFO("Swapchains rebuilt at scale %.2f in %.3f ms", program->resolutionScale, (time_now_ns() - start) / 1000000.0);
+    vulkan_memory_query_budget(vulkan);
+    vulkan_memory_report(vulkan, "swapchains resized");
+    return true;
+}
+
+// NOTE: picks up supersampling changes from RESOLUTION_SCALE_PROPERTY and new recommended sizes from the runtime
+static bool program_poll_swapchain_size(OpenXrProgram* program, VulkanState* vulkan) {
+    uint64_t now = time_now_ns();
+    if (vulkan->transientReleased || now - program->lastSizePoll < SWAPCHAIN_SIZE_POLL_NS) {
+        return true;
+    }
+    program->lastSizePoll = now;
+    program->resolutionScale = program_read_resolution_scale();
+
+    uint32_t viewCount = 0;
+    XrResult result = xrEnumerateViewConfigurationViews(
+        program->instance,
+        program->systemID,
+        program->viewConfigType,
+        NUM_VIEWES,
+        &viewCount,
+        program->configViews);
+    CHECKXR(result, "Failed to enumerate view configs");
+
+    bool changed = false;
+    for (uint32_t i = 0; i < viewCount; ++i) {
+        XrExtent2Di size = program_swapchain_size(program, i);
+        changed = changed || size.width != program->swapchains[i].width || size.height != program->swapchains[i].height;
+    }
+    return !changed || program_rebuild_swapchains(program, vulkan);
+}
+
 static bool program_render_frame(OpenXrProgram* program, VulkanState* vulkan) {
     XrFrameWaitInfo waitInfo = {
         .type = XR_TYPE_FRAME_WAIT_INFO};
@@ -2302,18 +5843,48 @@ static bool program_render_frame(OpenXrProgram* program, VulkanState* vulkan) {
     result = xrBeginFrame(program->session, &frameBegin);
     CHECKXR(result, "Failed to begin frame");
 
+    vulkan_deferred_collect(vulkan);
+    vulkan_memory_update(vulkan);
+    if (!vulkan_upload_pump(vulkan)) {
+        return false;
+    }
+    if (!vulkan_pipeline_retire_linked(vulkan)) {
+        CERROR("Failed to retire fast linked pipelines");
+        return false;
+    }
+    if (!program_poll_swapchain_size(program, vulkan)) {
+        CERROR("Failed to resize swapchains");
+        return false;
+    }
+
     XrCompositionLayerProjection layers[1];
     XrCompositionLayerProjectionView projectionLayerViews[NUM_VIEWES];
+    uint32_t layerCount = 0;
 
-    if (!program_render_layer(
-            program,
-            vulkan,
-            frameState.predictedDisplayTime,
-            projectionLayerViews,
-            array_size(projectionLayerViews),
-            layers)) {
-        CERROR("Failed to render layer");
-        return false;
+    // NOTE: while the transient resources are released there is nothing to render into, submit an empty frame
+    if (!vulkan->transientReleased) {
+        if (program_render_layer(
+                program,
+                vulkan,
+                frameState.predictedDisplayTime,
+                projectionLayerViews,
+                array_size(projectionLayerViews),
+                layers)) {
+            layerCount = 1;
+        } else {
+            // NOTE: the frame still ends, without layers, so the runtime's frame loop keeps going
+            CERROR("Failed to render layer, ending the frame empty");
+            if (!program_drain_swapchain_images(program)) {
+                CERROR("Failed to drain swapchain images");
+                return false;
+            }
+        }
+    }
+    if (layerCount) {
+        program_update_resolution(program, vulkan, frameState.predictedDisplayPeriod);
+#if defined(XR_META_recommended_layer_resolution)
+        program_query_layer_resolution(program, layers, frameState.predictedDisplayTime);
+#endif
     }
 
     const XrCompositionLayerBaseHeader* ppLayers = layers;
@@ -2322,44 +5893,196 @@ static bool program_render_frame(OpenXrProgram* program, VulkanState* vulkan) {
         .type = XR_TYPE_FRAME_END_INFO,
         .displayTime = frameState.predictedDisplayTime,
         .environmentBlendMode = program->environmentBlendMode,
-        .layerCount = 1,
+        .layerCount = layerCount,
         .layers = &ppLayers};
     result = xrEndFrame(program->session, &frameEndInfo);
     CHECKXR(result, "Failed to end frame");
     return true;
 }
 
-#define VKDESTROY(cmd, item)          \
-    if (item) {                       \
-        cmd(vulkan->device, item, 0); \
-        item = 0;                     \
+#define VKDESTROY(cmd, item)                          \
+    if (item) {                                       \
+        cmd(vulkan->device, item, vulkan->allocator); \
+        item = 0;                                     \
     }
 
 static void vulkan_cleanup(VulkanState* vulkan) {
+    if (vulkan->device) {
+        // NOTE: the upload worker may be submitting, the device wait below needs every queue to itself
+        vulkan_upload_shutdown(vulkan);
+        if (!vulkan_frame_sync_wait(vulkan, vulkan->frameSync.submitted, GPU_WAIT_TIMEOUT_NS)) {
+            vkDeviceWaitIdle(vulkan->device);
+        }
+        for (uint32_t i = 0; i < vulkan->deferredDestroys.count; ++i) {
+            vulkan_destroy_handle(vulkan, &vulkan->deferredDestroys.items[i]);
+        }
+        vulkan->deferredDestroys.count = 0;
+    }
+
     for (uint32_t view = 0; view < NUM_VIEWES; ++view) {
         for (uint32_t image = 0; image < vulkan->swapchainImageContext[view].imageCount; ++image) {
             VKDESTROY(vkDestroyFramebuffer, vulkan->swapchainImageContext[view].renderTarget[image].fb);
             VKDESTROY(vkDestroyImageView, vulkan->swapchainImageContext[view].renderTarget[image].colorView);
             VKDESTROY(vkDestroyImageView, vulkan->swapchainImageContext[view].renderTarget[image].depthView);
+            VKDESTROY(vkDestroyImageView, vulkan->swapchainImageContext[view].renderTarget[image].densityView);
         }
 
         VKDESTROY(vkDestroyImage, vulkan->swapchainImageContext[view].depthBuffer.depthImage);
-        VKDESTROY(vkFreeMemory, vulkan->swapchainImageContext[view].depthBuffer.depthMemory);
-        VKDESTROY(vkDestroyRenderPass, vulkan->swapchainImageContext[view].rp.pass);
+        vulkan_memory_free(vulkan, &vulkan->swapchainImageContext[view].depthBuffer.depthMemory);
+        VKDESTROY(vkDestroyImageView, vulkan->swapchainImageContext[view].msaaColor.colorView);
+        VKDESTROY(vkDestroyImage, vulkan->swapchainImageContext[view].msaaColor.colorImage);
+        vulkan_memory_free(vulkan, &vulkan->swapchainImageContext[view].msaaColor.colorMemory);
+        VKDESTROY(vkDestroyImageView, vulkan->swapchainImageContext[view].shadingMap.view);
+        VKDESTROY(vkDestroyImage, vulkan->swapchainImageContext[view].shadingMap.image);
+        vulkan_memory_free(vulkan, &vulkan->swapchainImageContext[view].shadingMap.memory);
+        VKDESTROY(vkDestroyBuffer, vulkan->swapchainImageContext[view].shadingMap.staging);
+        vulkan_memory_free(vulkan, &vulkan->swapchainImageContext[view].shadingMap.stagingMemory);
+    }
+    for (uint32_t i = 0; i < vulkan->renderPassCount; ++i) {
+        VKDESTROY(vkDestroyRenderPass, vulkan->renderPasses[i].pass);
+    }
+    vulkan->renderPassCount = 0;
+    for (uint32_t i = 0; i < NUM_VIEWES; ++i) {
+        if (vulkan->cmdBuffer[i].buf) {
+            vkFreeCommandBuffers(vulkan->device, vulkan->cmdBuffer[i].pool, 1, &vulkan->cmdBuffer[i].buf);
+            vulkan->cmdBuffer[i].buf = 0;
+        }
+        VKDESTROY(vkDestroyCommandPool, vulkan->cmdBuffer[i].pool);
+        VKDESTROY(vkDestroyFence, vulkan->cmdBuffer[i].execFence);
+    }
+    VKDESTROY(vkDestroySemaphore, vulkan->frameSync.timeline);
+    VKDESTROY(vkDestroyQueryPool, vulkan->gpuTimer.pool);
+    if (vulkan->upload.stagingMapped) {
+        vkUnmapMemory(vulkan->device, vulkan->upload.stagingMem);
+        vulkan->upload.stagingMapped = 0;
     }
-    if (vulkan->cmdBuffer.buf) {
-        vkFreeCommandBuffers(vulkan->device, vulkan->cmdBuffer.pool, 1, &vulkan->cmdBuffer.buf);
-        vulkan->cmdBuffer.buf = 0;
+    VKDESTROY(vkDestroyCommandPool, vulkan->upload.pool);
+    VKDESTROY(vkDestroyFence, vulkan->upload.fence);
+    VKDESTROY(vkDestroyBuffer, vulkan->upload.staging);
+    vulkan_memory_free(vulkan, &vulkan->upload.stagingMem);
+    for (uint32_t i = 0; i < vulkan->descriptors.poolCount; ++i) {
+        VKDESTROY(vkDestroyDescriptorPool, vulkan->descriptors.pools[i]);
     }
-    VKDESTROY(vkDestroyCommandPool, vulkan->cmdBuffer.pool);
-    VKDESTROY(vkDestroyFence, vulkan->cmdBuffer.execFence);
+    vulkan->descriptors.poolCount = 0;
+    if (vulkan->frame.ring.mapped) {
+        vkUnmapMemory(vulkan->device, vulkan->frame.ring.mem);
+        vulkan->frame.ring.mapped = 0;
+    }
+    VKDESTROY(vkDestroyBuffer, vulkan->frame.ring.buf);
+    vulkan_memory_free(vulkan, &vulkan->frame.ring.mem);
+    vulkan_pipeline_compiler_shutdown(vulkan);
+    if (vulkan->pipelines.count) {
+        CINFO("Pipeline cache: %u pipelines, %u hits, %u views skipped while compiling, %.3f ms compiling",
+              vulkan->pipelines.count, vulkan->pipelines.hits, vulkan->pipelines.skipped, vulkan->pipelines.createNs / 1000000.0);
+    }
+    for (uint32_t i = 0; i < MAX_PIPELINES; ++i) {
+        VKDESTROY(vkDestroyPipeline, vulkan->pipelines.entries[i].pipe);
+        VKDESTROY(vkDestroyPipeline, vulkan->pipelines.entries[i].fastPipe);
+        atomic_store_explicit(&vulkan->pipelines.entries[i].state, PIPELINE_Empty, memory_order_relaxed);
+    }
+    vulkan->pipelines.count = 0;
+    for (uint32_t i = 0; i < MAX_PIPELINE_LIBRARIES; ++i) {
+        VKDESTROY(vkDestroyPipeline, vulkan->pipelines.libraries[i].lib);
+    }
+    vulkan->pipelines.libraryCount = 0;
+    VKDESTROY(vkDestroyPipelineCache, vulkan->pipelines.driverCache);
     VKDESTROY(vkDestroyPipelineLayout, vulkan->pipelineLayout);
+    VKDESTROY(vkDestroyDescriptorSetLayout, vulkan->frameSetLayout);
     VKDESTROY(vkDestroyShaderModule, vulkan->shaderProgram[0].module);
     VKDESTROY(vkDestroyShaderModule, vulkan->shaderProgram[1].module);
     VKDESTROY(vkDestroyBuffer, vulkan->drawBuffer.idxBuf);
     VKDESTROY(vkDestroyBuffer, vulkan->drawBuffer.vtxBuf);
-    VKDESTROY(vkFreeMemory, vulkan->drawBuffer.idxMem);
-    VKDESTROY(vkFreeMemory, vulkan->drawBuffer.vtxMem);
+    vulkan_memory_free(vulkan, &vulkan->drawBuffer.idxMem);
+    vulkan_memory_free(vulkan, &vulkan->drawBuffer.vtxMem);
+    vulkan_host_allocator_report(vulkan, "cleanup");
+}
+
+static bool vulkan_release_transient_resources(VulkanState* vulkan) {
+    if (vulkan->transientReleased) {
+        return true;
+    }
+
+    VkDeviceSize released = 0;
+    uint32_t objects = 0;
+    for (uint32_t view = 0; view < NUM_VIEWES; ++view) {
+        if (!vulkan_retire_view_targets(vulkan, &vulkan->swapchainImageContext[view], &released, &objects)) {
+            return false;
+        }
+    }
+
+    // NOTE: nothing is recorded while paused, so the frame set isn't used until the ring is rebuilt and it is written again
+    FrameRing* ring = &vulkan->frame.ring;
+    if (ring->buf) {
+        released += ring->regionSize * FRAMES_IN_FLIGHT;
+        ++objects;
+    }
+    VKRETIRE(Buffer, buffer, ring->buf);
+    VKRETIRE(Memory, memory, ring->mem);  // NOTE: freeing unmaps it
+    ring->mapped = 0;
+
+    // NOTE: every frame is waited on before the pause, so this normally frees everything right away
+    vulkan_deferred_collect(vulkan);
+
+    vulkan->transientReleased = true;
+    CINFO("Low memory pause: released %llu bytes of GPU memory (%u objects, %u handles still in flight)",
+          (unsigned long long)released, objects, vulkan->deferredDestroys.count);
+    vulkan_memory_query_budget(vulkan);
+    vulkan_memory_report(vulkan, "low memory pause");
+    return true;
+}
+
+static bool vulkan_restore_transient_resources(VulkanState* vulkan) {
+    if (!vulkan->transientReleased) {
+        return true;
+    }
+
+    uint64_t start = time_now_ns();
+    VkDeviceSize restored = 0;
+    if (!vulkan_frame_ring_init(vulkan, FRAME_RING_REGION_SIZE, &vulkan->frame.ring)) {
+        CERROR("Failed to restore frame ring");
+        return false;
+    }
+    vulkan_frame_set_write(vulkan);
+    restored += vulkan->frame.ring.regionSize * FRAMES_IN_FLIGHT;
+
+    for (uint32_t view = 0; view < NUM_VIEWES; ++view) {
+        SwapchainImageContext* context = &vulkan->swapchainImageContext[view];
+        if (!context->imageCount) {
+            continue;
+        }
+
+        if (!vulkan_depth_buffer_create(vulkan, context->rp.depthFmt, context->size, context->samples, !context->submitDepth, &context->depthBuffer)) {
+            CERROR("Failed to restore depth buffer, View[%u]", view);
+            return false;
+        }
+        restored += context->depthBuffer.size;
+
+        if (context->samples > VK_SAMPLE_COUNT_1_BIT) {
+            if (!vulkan_msaa_color_create(vulkan, context->rp.colorFmt, context->size, context->samples, &context->msaaColor)) {
+                CERROR("Failed to restore MSAA color buffer, View[%u]", view);
+                return false;
+            }
+            restored += context->msaaColor.size;
+        }
+
+        if (!vulkan_shading_map_create(vulkan, context)) {
+            CERROR("Failed to restore foveation map, View[%u]", view);
+            return false;
+        }
+        restored += context->shadingMap.size;
+
+        // NOTE: build the render targets now so the first frame after resume doesn't pay for them
+        for (uint32_t image = 0; image < context->imageCount; ++image) {
+            if (!vulkan_create_render_target(vulkan, view, image)) {
+                CERROR("Failed to restore render target %u:%u", view, image);
+                return false;
+            }
+        }
+    }
+
+    vulkan->transientReleased = false;
+    CINFO("Low memory pause: restored %llu bytes in %.3f ms", (unsigned long long)restored, (time_now_ns() - start) / 1000000.0);
+    return true;
 }
 
 static void program_cleanup(OpenXrProgram* program) {
@@ -2395,11 +6118,57 @@ static void program_cleanup(OpenXrProgram* program) {
     }
 }
 
+static void app_handle_cmd(struct android_app* app, int32_t cmd) {
+    AndroidAppState* state = (AndroidAppState*)app->userData;
+
+    switch (cmd) {
+        case APP_CMD_START: {
+            CINFO("onStart()");
+        } break;
+        case APP_CMD_RESUME: {
+            CINFO("onResume()");
+            state->resumed = true;
+            if (state->vulkan && state->vulkan->transientReleased) {
+                if (!vulkan_restore_transient_resources(state->vulkan)) {
+                    CERROR("Failed to restore transient resources");
+                }
+            }
+        } break;
+        case APP_CMD_PAUSE: {
+            CINFO("onPause()");
+            state->resumed = false;
+            if (state->lowMemoryPause && state->vulkan && state->vulkan->device) {
+                if (!vulkan_release_transient_resources(state->vulkan)) {
+                    CERROR("Failed to release transient resources");
+                }
+            }
+        } break;
+        case APP_CMD_STOP: {
+            CINFO("onStop()");
+        } break;
+        case APP_CMD_DESTROY: {
+            CINFO("onDestroy()");
+            state->window = 0;
+        } break;
+        case APP_CMD_INIT_WINDOW: {
+            CINFO("surfaceCreated()");
+            state->window = app->window;
+        } break;
+        case APP_CMD_TERM_WINDOW: {
+            CINFO("surfaceDestroyed()");
+            state->window = 0;
+        } break;
+    }
+}
+
 void android_main(struct android_app* app) {
     JNIEnv* env;
     (*app->activity->vm)->AttachCurrentThread(app->activity->vm, &env, 0);
 
-    AndroidAppState state = {};
+    VulkanState vulkan = {};
+    AndroidAppState state = {
+        .lowMemoryPause = true,
+        .vulkan = &vulkan};
 
     app->userData = &state;
     app->onAppCmd = app_handle_cmd;
@@ -2410,13 +6179,13 @@ void android_main(struct android_app* app) {
         .applicationActivity = app->activity->clazz};
 
     bool requestRestart = false;  // TODO: remove?
-    bool exitRenderLoop = false;  // TODO: remove?
+    bool exitRenderLoop = false;
 
-    VulkanState vulkan = {};
     for (uint32_t i = 0; i < NUM_VIEWES; ++i) {
         vulkan.swapchainImageContext[i].topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
         vulkan.swapchainImageContext[i].swapchainImageType = XR_TYPE_SWAPCHAIN_IMAGE_VULKAN2_KHR;
-        vulkan.swapchainImageContext[i].depthBuffer.vkLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+        vulkan.swapchainImageContext[i].depthBuffer.state = IMAGE_STATE_UNDEFINED;
+        vulkan.swapchainImageContext[i].submitDepth = false;
     }
 
     OpenXrProgram program = {
@@ -2424,6 +6193,18 @@ void android_main(struct android_app* app) {
         .viewConfigType = XR_VIEW_CONFIGURATION_TYPE_PRIMARY_STEREO,
         .environmentBlendMode = XR_ENVIRONMENT_BLEND_MODE_OPAQUE,
         .graphicsBinding = {.type = XR_TYPE_GRAPHICS_BINDING_VULKAN2_KHR},
+        .configViews = {
+            {.type = XR_TYPE_VIEW_CONFIGURATION_VIEW},
+            {.type = XR_TYPE_VIEW_CONFIGURATION_VIEW}},
+        .resolutionScale = RESOLUTION_SCALE,
+        .resolution = {
+            .scale = 1.0f,
+            .maxScale = 1.0f},
+        .foveation = {
+            .level = FOVEATION_LEVEL,
+            .swapchainCI = {
+                .type = XR_TYPE_SWAPCHAIN_CREATE_INFO_FOVEATION_FB,
+                .flags = XR_SWAPCHAIN_CREATE_FOVEATION_FRAGMENT_DENSITY_MAP_BIT_FB}},
         .input = {
             .handScale = {1.0f, 1.0f}}};
 
@@ -2449,7 +6230,8 @@ void android_main(struct android_app* app) {
     }
 
     if (result) {
-        while (app->destroyRequested == 0) {
+        // NOTE: poll_events clears exitRenderLoop, so a failure later in the iteration is seen by the check here
+        while (app->destroyRequested == 0 && !exitRenderLoop) {
             for (;;) {
                 int events;
                 struct android_poll_source* source;
@@ -2479,13 +6261,29 @@ void android_main(struct android_app* app) {
                 exitRenderLoop = true;
             }
 
-            if (!program_render_frame(&program, &vulkan)) {
+            vulkan_host_allocator_frame(&vulkan, true);
+            bool rendered = program_render_frame(&program, &vulkan);
+            vulkan_host_allocator_frame(&vulkan, false);
+            if (!rendered) {
                 CERROR("Failed to render frame");
                 exitRenderLoop = true;
             }
         }
     }
 
+    // NOTE: the glue expects android_main to keep handling commands until the activity is gone
+    if (app->destroyRequested == 0) {
+        CINFO("Leaving the render loop, finishing the activity");
+        ANativeActivity_finish(app->activity);
+        while (app->destroyRequested == 0) {
+            int events;
+            struct android_poll_source* source;
+            if (ALooper_pollAll(-1, 0, &events, (void**)&source) >= 0 && source) {
+                source->process(app, source);
+            }
+        }
+    }
+
     vulkan_cleanup(&vulkan);
     program_cleanup(&program);
     (*app->activity->vm)->DetachCurrentThread(app->activity->vm);
@@ -0,0 +1,33 @@
+#version 450
+
+// NOTE: specialization constants, ids match SPEC_* in main.c
+layout(constant_id = 0) const bool INSTANCED = true;  // false: geometry is already in world space, no per-object data
+
+layout(std140, set = 0, binding = 0) uniform Camera {
+    mat4 view;
+    mat4 proj;
+} camera;
+
+struct ObjectData {
+    mat4 model;
+    vec4 color;
+};
+
+layout(std430, set = 0, binding = 1) readonly buffer Objects {
+    ObjectData objects[];
+};
+
+layout(location = 0) in vec3 Position;
+layout(location = 1) in vec3 Color;
+
+layout(location = 0) out vec4 oColor;
+
+void main() {
+    vec4 world = vec4(Position, 1.0);
+    oColor = vec4(Color, 1.0);
+    if (INSTANCED) {
+        world = objects[gl_InstanceIndex].model * world;
+        oColor *= objects[gl_InstanceIndex].color;
+    }
+    gl_Position = camera.proj * (camera.view * world);
+}